@@ -94,8 +94,12 @@
 #include "nrf_pwm.h"
 #include "nrf_timer.h"
 #include "nrf_uarte.h"    
+#include "nrf_saadc.h"
 #include "vl6180.h"
 #include "nrf_drv_pdm.h"
+#include "nrf_fstorage.h"
+#include "nrf_fstorage_sd.h"
+#include "nrf_atfifo.h"
 
 //COMMAND SET FOR BLE
 #define MOTORS_RIGHT_30     0x08
@@ -109,6 +113,7 @@
 #define MOTORS_SLEEP        0x16
 #define MOTORS_SPEED        0x50
 #define DO_DFT              0x51
+#define TOGGLE_DFT_Q15      0x52
 #define PLAY_BUZZER         0x17
 //The next two in Android yet
 #define DEC_STEP_MODE       0x18
@@ -120,9 +125,28 @@
 #define INCREASE_GAIN       0x31
 #define DECREASE_GAIN       0x32
 #define RECORD_SOUND_PI     0x33
+#define LISTEN_TONES        0x34
+#define SET_TONE            0x35    //4 byte command, speed field is the freq in Hz, code is the tone slot
+#define VAD_RECORD          0x36    //arm/disarm sound triggered recording
+#define LEVEL_METER         0x37    //start/stop the sound level notifies
+#define AGC_TOGGLE          0x38    //automatic mic gain on/off, INCREASE/DECREASE_GAIN turn it off
+#define FILTER_TOGGLE       0x39    //dc block and motor notch filters on the mic on/off
+#define FLASH_RECORD        0x3A    //start/stop a long recording to flash, Pi reads it like RECORD_SOUND_PI
+#define PLAY_CLIP           0x3B    //play the last recording through the buzzer, again to stop
+#define SONG_NOTE           0x3C    //4 byte command, speed is the freq in Hz (0 rest), code the length in 10ms
+#define SONG_SAVE           0x3D    //4 byte command, code is the slot, the notes sent so far become that song
+#define PLAY_SONG           0x3E    //4 byte command, code is the slot, speed non zero repeats, again to stop
+#define CMD_STATS           0x3F    //command queue counters, EVENT_QUEUE and the UART
 #define ROVER_MODE          0x40
 #define FOTOV_MODE          0x41
 #define ROVER_MODE_REV      0x42
+#define TELEMETRY_RATE      0x43    //4 byte command, speed is the telemetry period in ms, 0 stops it
+#define RELAY_SELECT        0x44    //4 byte command, code is the mask of relay slots commands go to, 0xFF all
+#define SWARM_LEAD          0x45    //broadcast every command run here to followers, again to stop
+#define SWARM_FOLLOW        0x46    //run the commands a swarm leader broadcasts, again to stop
+#define BEACON_RATE         0x47    //4 byte command, speed is the beacon update period in ms, 0 stops it
+#define BOND_MODE           0x48    //bond with the next controller and reconnect to it fast, again forgets it
+#define TONE_COMMAND        0x49    //4 byte command, code is the tone slot, speed is the command to run when it's heard, 0 none
 /*
     Conditional compilation
     ========================================================
@@ -131,12 +155,24 @@
     SPARTFUN 0 = Tiny Robot firmware
     ADHOC_TEST = ad hoc test - targeted for debugging a specific thing
     MOTORS_STEPPING_PWM = enables PWM functions for use in stepping, you must disable gpio/timer1
+    DFT_BENCHMARK = times the f32 and q15 spectrum paths at 64-1024 points on the UART at startup, then stops
+    CMD_QUEUE_TEST = bursts commands from every CMD_SRC_* into the command queue at startup, some from a timer
+                     interrupt, checks what comes out for loss and order, reports on the UART, then carries on
+    AGC_DIGITAL = lets the mic AGC add up to 18dB of digital gain past the PDM's +20dB, for far away sounds
+    SMALL_SOUND_BUFFER = 1/4s RAM sound buffer instead of 1s, gives back 24k of RAM, long clips go to flash anyway.
+                         RECORD_SOUND, the VAD pre-roll and the clip service all shrink to 1/4s with it.
+                         MTU 247 is opt in and needs it: set NRF_SDH_BLE_GATT_MAX_MTU_SIZE to 247 in sdk_config.h,
+                         this to 1, and move the RAM start up 0xC00 in the .ld and the .emProject
 */
 #define MB_TEST     0
 #define MICROPHONE  0
 #define SPARKFUN    0
 #define ADHOC_TEST  0
 #define MOTORS_STEPPING_PWM 0
+#define DFT_BENCHMARK 0
+#define CMD_QUEUE_TEST 0
+#define AGC_DIGITAL 0
+#define SMALL_SOUND_BUFFER 0
 #if MB_TEST
 #define SPARKFUN 0
 #endif
@@ -194,17 +230,24 @@
 #define MANUFACTURER_NAME               "William Weiler Eng"                    /**< Manufacturer. Will be passed to Device Information Service. */
 #define APP_BLE_OBSERVER_PRIO           3                                       /**< Application's BLE observer priority. You shouldn't need to modify this value. */
 #define APP_BLE_CONN_CFG_TAG            1                                       /**< A tag identifying the SoftDevice BLE configuration. */
+#define RELAY_CONN_CFG_TAG              2                                       /**< Relay links, small MTU and a short event so RELAY_LINKS of them fit. */
+#define RELAY_EVENT_LENGTH              2                                       /**< 2.5ms, a few write commands each interval is all a relay link carries. */
 
 #define SCAN_INTERVAL                   0x00A0                              /**< Determines scan interval in units of 0.625 millisecond. */
 #define SCAN_WINDOW                     0x0050                              /**< Determines scan window in units of 0.625 millisecond. */
 #define SCAN_TIMEOUT                    0x0000                              /**< Timout when scanning. 0x0000 disables timeout. */
+#define SWARM_SCAN_INTERVAL             0x0050                              /**< Follower scan interval and window, 50ms in units of 0.625 millisecond. */
+#define SWARM_ADV_INTERVAL              BLE_GAP_ADV_INTERVAL_MIN            /**< Leader broadcast interval, 20ms, followers hear a command within one. */
 #define MIN_CONNECTION_INTERVAL         MSEC_TO_UNITS(7.5, UNIT_1_25_MS)    /**< Determines minimum connection interval in milliseconds. */
 #define MAX_CONNECTION_INTERVAL         MSEC_TO_UNITS(30, UNIT_1_25_MS)     /**< Determines maximum connection interval in milliseconds. */
 #define SUPERVISION_TIMEOUT             MSEC_TO_UNITS(4000, UNIT_10_MS)     /**< Determines supervision time-out in units of 10 milliseconds. */
 #define UUID16_SIZE                     2                                   /**< Size of a UUID, in bytes. */
 
-#define APP_ADV_INTERVAL                64                                      /**< The advertising interval (in units of 0.625 ms; this value corresponds to 40 ms). */
-#define APP_ADV_TIMEOUT_IN_SECONDS      BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED   /**< The advertising time-out (in units of seconds). When set to 0, we will never time out. */
+#define APP_ADV_INTERVAL                64                                      /**< The beacon's advertising interval while connected (in units of 0.625 ms; this value corresponds to 40 ms). */
+#define APP_ADV_FAST_INTERVAL           MSEC_TO_UNITS(20, UNIT_0_625_MS)        /**< Fast advertising interval, a controller finds the robot right away. */
+#define APP_ADV_FAST_TIMEOUT            30                                      /**< Fast advertising time-out (in units of seconds), then slow. */
+#define APP_ADV_SLOW_INTERVAL           MSEC_TO_UNITS(1000, UNIT_0_625_MS)      /**< Slow advertising interval, for a robot left on and not connected. */
+#define APP_ADV_SLOW_TIMEOUT            BLE_GAP_ADV_TIMEOUT_GENERAL_UNLIMITED   /**< Slow advertising never times out. */
 
 #define MIN_CONN_INTERVAL               MSEC_TO_UNITS(10, UNIT_1_25_MS)        /**< Minimum acceptable connection interval 50Hz*/
 #define MAX_CONN_INTERVAL               MSEC_TO_UNITS(40, UNIT_1_25_MS)        /**< Maximum acceptable connection interval 25Hz*/
@@ -221,8 +264,8 @@ static uint8_t m_gap_role     = BLE_GAP_ROLE_INVALID;
 static char const m_target_periph_name[] = "Skoobot";                           /**< Name of the device we try to connect to. This name is searched in the scan report data*/
 static void on_ble_gap_evt_connected(ble_gap_evt_t const * p_gap_evt);
 static void db_disc_handler(ble_db_discovery_evt_t * p_evt);
-BLE_DB_DISCOVERY_DEF(m_db_disc);                                                /**< DB discovery module instance. */
-/**@brief Parameters used when scanning. */
+BLE_DB_DISCOVERY_ARRAY_DEF(m_db_disc, NRF_SDH_BLE_CENTRAL_LINK_COUNT);          /**< DB discovery module instances, one per relay link. */
+/**@brief Parameters used when scanning for robots to relay to, active, a beaconing robot's UUID is in its scan response. */
 static ble_gap_scan_params_t const m_scan_params =
 {
     .active   = 1,
@@ -237,6 +280,21 @@ static ble_gap_scan_params_t const m_scan_params =
         .use_whitelist = 0,
     #endif
 };
+/**@brief Parameters used when following a swarm leader, passive and the window covers the whole interval. */
+static ble_gap_scan_params_t const m_swarm_scan_params =
+{
+    .active   = 0,
+    .interval = SWARM_SCAN_INTERVAL,
+    .window   = SWARM_SCAN_INTERVAL,
+    .timeout  = SCAN_TIMEOUT,
+    #if (NRF_SD_BLE_API_VERSION <= 2)
+        .selective   = 0,
+        .p_whitelist = NULL,
+    #endif
+    #if (NRF_SD_BLE_API_VERSION >= 3)
+        .use_whitelist = 0,
+    #endif
+};
 /**@brief Connection parameters requested for connection. */
 static ble_gap_conn_params_t const m_connection_param =
 {
@@ -274,6 +332,14 @@ NRF_SDH_BLE_OBSERVER(_name ## _obs,                                           \
 #define LBS_UUID_BYTE2_CHAR  0x1526
 #define LBS_UUID_BYTE128_CHAR 0x1527
 #define LBS_UUID_BYTE4_CHAR  0x1528
+#define LBS_UUID_EVENT_CHAR  0x1529
+#define LBS_UUID_LEVEL_CHAR  0x152A
+#define LBS_UUID_FRAME_CHAR  0x152B
+#define LBS_UUID_TELEM_CHAR  0x152C
+#define LBS_UUID_STREAM_RX_CHAR 0x152D
+#define LBS_UUID_STREAM_TX_CHAR 0x152E
+#define LBS_UUID_CLIP_SERVICE 0x1530
+#define LBS_UUID_SLICE_CHAR  0x1540    //0x1540 up, one per slice of p_rx_buffer
 
 BLE_SKOOBOT_DEF_P(m_skoobot_p);
 BLE_SKOOBOT_DEF_C(m_skoobot_c);
@@ -282,14 +348,14 @@ NRF_BLE_GATT_DEF(m_gatt);
 // BLE Data, declare and Initialize
 ble_uuid_t ble_uuid_svc;
 uint16_t m_conn_p_handle = BLE_CONN_HANDLE_INVALID;                      
-uint16_t m_conn_c_handle = BLE_CONN_HANDLE_INVALID;                      
 uint8_t g_inbyte = 0;
 uint16_t svc_handle;
-ble_gatts_char_handles_t data_handle, cmd_handle, remote_cmd_handle;
-ble_gatts_char_handles_t data_2byte_handle, data_4byte_handle, data_128byte_handle;
+ble_gatts_char_handles_t data_handle, cmd_handle;
+ble_gatts_char_handles_t data_2byte_handle, data_4byte_handle, data_128byte_handle, event_handle, level_handle;
+ble_gatts_char_handles_t frame_handle, telem_handle, stream_rx_handle, stream_tx_handle;
 uint8_t uuid_type;
 uint8_t cmd_value = 0, data_value = 0, BLE_P_Connected = 0, BLE_C_Connected = 0, new_cmd = 0;
-uint8_t data_2byte_val[2], data_4byte_val[4];
+uint8_t data_2byte_val[2], data_4byte_val[4], event_val[4], level_val[6];
 ble_gatts_value_t sound_value, sound_flag, data4_value, data_val;    //for Raspberry Pi and Samsung phone
 uint8_t pi_reads_active = 0, found_skoobot = 0;
 //BLE prototype functions
@@ -301,50 +367,519 @@ static void gatt_init(void);
 static void services_init(void);
 static void advertising_init(void);
 static void conn_params_init(void);
-static void advertising_start(void);
+static void advertising_start(ble_adv_mode_t mode);
 static uint32_t add_cmd_characteristic(void);
 static uint32_t add_data_characteristic(void);
 static uint32_t add_data2_characteristic(void);
 static uint32_t add_mult_data_characteristics(void);
 static uint32_t add_cmd4_characteristic(void);
+static uint32_t add_event_characteristic(void);
+static uint32_t add_level_characteristic(void);
+static uint32_t add_frame_characteristic(void);
+static uint32_t add_telem_characteristic(void);
+static uint32_t add_stream_rx_characteristic(void);
+static uint32_t add_stream_tx_characteristic(void);
 static uint32_t update_remote_byte(void);    //sends uint8_t data_value
 static uint32_t update_remote_2byte(void);    //sends 2 uint8_t or unit16_t data2_value
+static uint32_t update_remote_event(uint8_t type, uint8_t id, uint16_t value);    //4 bytes, type, id, value hi, value lo
+//event types on the event characteristic
+#define EVENT_TONE          0x01    //id is the tone slot, value is its freq
+#define EVENT_CLIP          0x02    //sound triggered clip is in p_rx_buffer, value is the trigger block
+#define EVENT_FLASH         0x03    //id 0 erasing, 1 recording, 2 clip ready with value = blocks
+#define EVENT_CONN          0x04    //id is the connection profile, value the interval in 1.25ms units
+#define EVENT_QUEUE         0x05    //id is the most commands ever waiting, value the commands dropped
+#define EVENT_STREAM        0x06    //id is the stream channel whose bulk send finished, value the frames
+#define EVENT_RELAY         0x07    //id is the relay slot, value 1 connected, 0 gone
+static uint32_t update_remote_level(void);    //6 bytes, rms hi/lo, peak hi/lo, clips, mic_gain
+static uint32_t update_remote_frame_ack(void);    //2 bytes, last executed seq, commands dropped (wraps)
+static uint32_t update_remote_telem(void);    //TELEM_LEN bytes, see telem_val
+//Telemetry, one snapshot of everything the host used to poll for, notified every telem_period ms.
+//The timer only flags it, the main loop builds it once from the sensor cache, then sends those same
+//bytes until the softdevice takes them.
+//telem_val, multi byte values hi first like the other characteristics
+//  0-3 ms since telemetry started, 4 range mm, 5-6 lux, 7 motor_state, 8 step mode, 9-10 step rate,
+//  11-14 step count, 15-16 mic rms, 17 mic_gain, 18 commands dropped (wraps), 19 other errors (stops at 255)
+#define TELEM_LEN            20                           //fits a 23 byte MTU
+#define TELEM_MIN_MS         150                          //the range and lux in it change once per sensor cycle
+#define TELEM_DUE            1                            //telem_due, tick, build it
+#define TELEM_BUILT          2                            //waiting on room to send it
+APP_TIMER_DEF(m_telem_timer);
+uint8_t telem_val[TELEM_LEN];
+uint16_t telem_period = 0;                                //ms, 0 is off
+volatile uint8_t telem_due = 0;
+volatile uint32_t telem_ms = 0;
+static void telem_rate(uint16_t period);
+static void telem_build(uint8_t step_mode, uint16_t speed);
+static void telem_timeout_handler(void * p_context);
+//Sensor cache, range, lux and VDD for telemetry and the beacon. Reading the VL6180 blocks 10ms and 100ms for the conversions, so the
+//reads are split around them. An app_timer paces the steps and the main loop does the TWI between, nothing
+//waits in nrf_delay_ms. It cycles while anything uses the cache and stops after the step it finds nobody.
+#define SENSOR_RANGE_MS      11                           //single shot range, 10ms
+#define SENSOR_ALS_MS        105                          //ALS integration is 100ms
+#define SENSOR_GAP_MS        40                           //between cycles, ~160ms each
+#define SENSOR_IDLE          0                            //sensor_step, what's running on the VL6180
+#define SENSOR_RANGE         1
+#define SENSOR_ALS           2
+APP_TIMER_DEF(m_sensor_timer);
+volatile uint8_t sensor_due = 0;
+uint8_t sensor_step = SENSOR_IDLE, sensor_running = 0, sensor_range = 0;
+uint16_t sensor_lux = 0, sensor_vdd = 0;
+static void sensor_start(void);
+static void sensor_poll(void);
+static void sensor_timeout_handler(void * p_context);
+//Command queue. Every command, 1 byte, 4 byte, frame records and tone triggers, goes into m_cmd_fifo as a whole
+//record with its args, so commands written between two passes of the main loop all get run, in order. on_write
+//puts from the softdevice event interrupt and the main loop gets, nrf_atfifo needs no locking for that.
+//A full queue drops the new command and counts it.
+#define CMD_QUEUE_LEN        32
+#define CMD_SRC_BYTE         0
+#define CMD_SRC_4BYTE        1
+#define CMD_SRC_FRAME        2
+#define CMD_SRC_TONE         3
+#define CMD_SRC_SWARM        4
+struct cmd_struct {
+  uint8_t src;
+  uint8_t seq;                                            //frames only
+  uint8_t cmd;
+  uint8_t args;                                           //1 if speed and code came with it
+  uint8_t code;
+  uint16_t speed;
+};
+NRF_ATFIFO_DEF(m_cmd_fifo, struct cmd_struct, CMD_QUEUE_LEN);
+uint32_t cmd_queued = 0, cmd_dropped = 0, cmd_run = 0;
+uint8_t cmd_args = 0;                                     //the command in cmd_value came with speed and code
+uint8_t cmd_src = CMD_SRC_BYTE;                           //and where it came from
+uint8_t cmd_depth_max = 0;
+static uint8_t cmd_put(uint8_t src, uint8_t seq, uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code);
+static uint8_t cmd_next(void);
+//Command frames. The frame characteristic takes write without response, so a host can put several commands
+//in one packet and several packets in one connection event without waiting on write responses. A frame is
+//records of seq, cmd and, when cmd has FRAME_ARGS set, speed hi, speed lo, code like the 4 byte command.
+//After one runs, the seq of the last one finished is notified back.
+#define FRAME_ARGS           0x80                         //cmd bit, 3 bytes of args follow
+uint8_t frame_running = 0, frame_seq_running = 0, frame_seq_done = 0, frame_ack_pending = 0;
+uint32_t frame_errors = 0;
+static void frame_parse(uint8_t const * p_data, uint16_t len);
+//Stream, an RX/TX characteristic pair like ble_nus. Both carry frames of channel, length, then length bytes.
+//Once the host turns on TX notifies, events, telemetry, frame acks, recordings, spectra and the UART log go
+//out as frames on it instead of their own characteristics, and recording/reading done are EVENT_STREAM
+//instead of 255 and 127 on data_handle. Everything queues into stream_tx, and stream_pump cuts that into
+//multi_len packets, frames run on from one packet into the next so every packet is full when there's data.
+//Flow control is per channel, in frames: the host grants credits on STREAM_CH_CTRL as pairs of channel,
+//credits, 0 pauses a channel, 255 lets it run without counting. The log starts paused, the rest run.
+//RX frames must be whole in one write.
+#define STREAM_CH_CTRL       0                            //RX only, credit grants
+#define STREAM_CH_CMD        1                            //RX frame records like the frame characteristic, TX acks
+#define STREAM_CH_EVENT      2                            //4 bytes like the event characteristic
+#define STREAM_CH_TELEM      3                            //telem_val
+#define STREAM_CH_AUDIO      4                            //recordings, int16_t little endian
+#define STREAM_CH_SPECTRUM   5                            //DFT output
+#define STREAM_CH_LOG        6                            //TxUART text
+#define STREAM_CHANNELS      7
+#define STREAM_HEADER        2
+#define STREAM_CHUNK         240                          //bulk payload per frame, whole samples
+#define STREAM_TX_SIZE       1024                         //power of 2
+#define STREAM_CREDIT_ANY    255
+uint8_t stream_tx[STREAM_TX_SIZE];
+volatile uint16_t stream_head = 0, stream_tail = 0;       //free running, masked on use
+uint8_t stream_credits[STREAM_CHANNELS];
+uint8_t stream_on = 0;                                    //host has TX notifies on
+struct stream_bulk_struct {
+  uint8_t const * p_data;
+  uint32_t len, pos;
+  uint16_t frames;
+  uint8_t ch;
+} stream_bulk;
+volatile uint8_t stream_bulk_busy = 0, stream_bulk_done = 0;
+uint32_t stream_drops = 0, stream_rx_errors = 0;
+uint32_t stream_send(uint8_t ch, void const * p_data, uint16_t len);
+uint32_t stream_bulk_start(uint8_t ch, void const * p_data, uint32_t len);
+static uint32_t stream_put(uint8_t ch, uint8_t const * p_src, uint16_t len);
+static void stream_pump(void);
+static void stream_reset(uint8_t on);
+static void stream_parse(uint8_t const * p_data, uint16_t len);
 static void db_disc_handler(ble_db_discovery_evt_t * p_evt);
 static void db_discovery_init(void);
 static void scan_start(void);
+//Relay, the central side. Up to RELAY_LINKS other Skoobots, each with the handles discovery found on it and its
+//own queue, since a link only takes one write command at a time until BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE.
+//Every command run here is forwarded, as a write command, to the links in relay_mask, bit n is slot n.
+//CONNECT_DISCONNECT scans and connects to every Skoobot it sees until the table is full, again stops the scan,
+//and again with links up and no scan disconnects them all. EVENT_RELAY tells the host which slot came and went.
+//A robot is one advertising LBS_UUID_SERVICE, or the exact name for older firmware that advertised it instead.
+//A beaconing robot has no room for the UUID next to the beacon and moves it to the scan response, so the relay
+//scan is active and takes the UUID from either. That costs a scan request and response per robot seen. Addresses connected to before are kept in relay_known and connect without parsing. The
+//softdevice's whitelist belongs to the Peer Manager's bond, so relay_known is checked here rather than by it.
+#define RELAY_LINKS          NRF_SDH_BLE_CENTRAL_LINK_COUNT
+#define RELAY_KNOWN          8
+#define RELAY_QUEUE_LEN      8                            //power of 2
+#define RELAY_ALL            0xFF
+struct relay_cmd_struct {
+  uint8_t len;                                            //1 for the cmd characteristic, 4 for the 4 byte one
+  uint8_t data[4];
+};
+struct relay_link_struct {
+  uint16_t conn_handle;
+  uint16_t cmd_handle, cmd4_handle;                       //0 until discovery finds them
+  struct relay_cmd_struct queue[RELAY_QUEUE_LEN];
+  uint8_t head, tail;                                     //free running, masked on use
+};
+struct relay_link_struct relay_links[RELAY_LINKS];
+uint8_t relay_cnt = 0, relay_mask = RELAY_ALL, relay_scanning = 0;
+uint8_t relay_connecting = 0;                             //sd_ble_gap_connect is out, until CONNECTED or the conn timeout
+uint32_t relay_dropped = 0;
+ble_gap_addr_t relay_known[RELAY_KNOWN];
+uint8_t relay_known_cnt = 0, relay_known_next = 0;
+struct adv_fields_struct {                                //what on_adv_report wants from a report, one pass
+  data_t name;                                            //complete name, or short if that's all there is
+  data_t manuf;
+  uint8_t robot_uuid;                                     //LBS_UUID_SERVICE is in a 128 bit UUID list
+};
+static void adv_report_fields(data_t const * p_advdata, struct adv_fields_struct * p_fields);
+static uint8_t relay_known_find(ble_gap_addr_t const * p_addr);
+static void relay_known_add(ble_gap_addr_t const * p_addr);
+static void relay_init(void);
+static int8_t relay_find(uint16_t conn_handle);
+static void relay_forward(uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code);
+static void relay_pump(uint8_t slot);
+static void relay_connect_disconnect(void);
+//Swarm broadcast, no connections. A leader puts each command it runs in the manufacturer data of
+//non-connectable advertising, with a sequence number, and keeps advertising it until the next one. Followers
+//scan passively and queue any command whose sequence number they haven't just run. A follower keeps following
+//after its own phone disconnects, so the main loop runs without a connection while swarm_follow is set.
+//Manufacturer data is the company id, SWARM_MAGIC, seq, cmd with FRAME_ARGS when args follow, speed hi, lo, code.
+#define SWARM_COMPANY_ID     0xFFFF                       //the Bluetooth SIG's id for testing
+#define SWARM_MAGIC          0x5B
+#define SWARM_DATA_LEN       6
+uint8_t swarm_lead = 0, swarm_follow = 0, swarm_seq = 0, swarm_seq_seen = 0, swarm_seen_any = 0;
+uint8_t swarm_data[SWARM_DATA_LEN];
+uint32_t swarm_heard = 0;
+static void swarm_lead_set(uint8_t on);
+static void swarm_follow_set(uint8_t on);
+static void swarm_broadcast(uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code);
+static void swarm_adv_report(data_t const * p_manuf);
+static uint8_t cmd_stays_here(uint8_t cmd);
+//Beacon, sensor readings in the manufacturer data of the advertising so a base station scanning passively can
+//watch any number of robots. The timer flags an update and the main loop, or the not connected loop, takes
+//the sensor cache and swaps the data in with ble_advdata_set, which doesn't restart the advertiser. While connected
+//it advertises non-connectable to carry it. A swarm leader's advertiser is busy, it doesn't beacon.
+//Manufacturer data is the company id, BEACON_MAGIC, seq, range mm, lux hi, lo, VDD mV hi, lo, motor_state, flags.
+#define BEACON_MAGIC         0x5C
+#define BEACON_DATA_LEN      9
+#define BEACON_MIN_MS        500                          //the sensor cache turns over every ~160ms
+#define BEACON_CONNECTED     0x01                         //beacon flags
+#define BEACON_FOLLOWING     0x02
+#define BEACON_RELAYING      0x04
+#define BEACON_MIC           0x08                         //mic is streaming, recording, listening or metering
+APP_TIMER_DEF(m_beacon_timer);
+uint8_t beacon_data[BEACON_DATA_LEN];
+uint16_t beacon_period = 0;                               //ms, 0 is off
+volatile uint8_t beacon_due = 0;
+static void beacon_rate(uint16_t period);
+static void beacon_update(void);
+static void beacon_timeout_handler(void * p_context);
+static uint16_t vdd_read(void);
+//Bonding, opt in. With BOND_MODE on the Peer Manager bonds with the controller and keeps only the latest one.
+//After a dropout advertising goes directed at it at high duty, which it can answer in a few ms, then for
+//the fast advertising phase only it can connect, then slow open advertising. Off, pairing is refused like it
+//always was and the bond is deleted. Bonds are in FDS, so bond_mode comes back on at boot if one is there.
+//A bonded address asking to pair again (a phone that lost its keys, or anything spoofing it) is only let in
+//while bond_armed, from BOND_MODE turning on until the next bond or disconnect, so off and on again re-pairs.
+uint8_t bond_mode = 0, adv_reconnect = 0;                 //adv_reconnect, advertising started from a dropout
+uint8_t bond_armed = 0;
+pm_peer_id_t bond_peer = PM_PEER_ID_INVALID;
+//Advertising, the ble_advertising module runs directed (bonded, after a dropout), fast for APP_ADV_FAST_TIMEOUT
+//then slow, changing mode on the softdevice's timeouts. Not connected the CPU sleeps between events, the
+//heartbeat is an app_timer at the advertising mode's pace.
+#define HEARTBEAT_FAST_MS    200
+#define HEARTBEAT_SLOW_MS    1000
+BLE_ADVERTISING_DEF(m_advertising);
+APP_TIMER_DEF(m_heartbeat_timer);
+volatile uint8_t heartbeat_due = 0;
+uint8_t heartbeat_led = 0;
+static void on_adv_evt(ble_adv_evt_t const adv_evt);
+static void adv_error_handler(uint32_t nrf_error);
+static void heartbeat_rate(uint16_t period);
+static void heartbeat_timeout_handler(void * p_context);
+static void power_manage(void);
+static void peer_manager_init(void);
+static void pm_evt_handler(pm_evt_t const * p_evt);
+static void bond_mode_set(uint8_t on);
 //len = 128 supported by BLE 4.1 and 4.2, 5.0 (my iPhone6)
 //len = 20 supported by BLE 4.0 (my Moto E4)
+//Now the MTU is negotiated per connection, up to NRF_SDH_BLE_GATT_MAX_MTU_SIZE (23 unless built for 247, see
+//SMALL_SOUND_BUFFER), 20 is only the starting size and what old phones stay at
 #define MULTI_LEN 20
-uint8_t data_128byte_val[MULTI_LEN];
-static uint32_t update_remote_multi_byte(uint32_t i);  
-static uint32_t update_remote_multi_byte_dft(uint32_t i);
+#define MULTI_LEN_MAX        (NRF_SDH_BLE_GATT_MAX_MTU_SIZE - 3)   //notification/read payload at the max MTU
+uint8_t data_128byte_val[MULTI_LEN_MAX];
+uint16_t multi_len = MULTI_LEN;               //packet size on the peripheral link, MTU-3 rounded to whole samples
+//Peers that drop the link in the middle of the MTU exchange (the Moto E4 does) are remembered, and the next time
+//they connect nrf_ble_gatt is told to leave them at 23 bytes and no DLE, so cheap phones keep working
+#define MTU_FALLBACK_PEERS   4
+static ble_gap_addr_t mtu_fallback_peers[MTU_FALLBACK_PEERS];
+static uint8_t mtu_fallback_cnt = 0, mtu_fallback_next = 0;
+static ble_gap_addr_t mtu_peer;
+static uint8_t mtu_settled = 0;
+static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt);
+static void mtu_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context);
+NRF_SDH_BLE_OBSERVER(m_mtu_obs, 0, mtu_on_ble_evt, NULL);     //ahead of nrf_ble_gatt so it asks for the right size
+//Transfer engine, sends a buffer as notifications on the 128 byte characteristic. It queues packets until the
+//softdevice's TX queue is full, then each BLE_GATTS_EVT_HVN_TX_COMPLETE queues more, so the link sets the pace
+//and the main loop carries on. Bytes go out as they sit in memory, little endian, same as the old copy loops.
+#define XFER_IDLE            0
+#define XFER_RUN             1
+#define XFER_DONE            2                            //all queued, main loop sends the 127 end flag
+struct xfer_struct {
+  uint8_t const * p_data;
+  uint32_t len, pos;                                      //bytes
+  uint32_t packets;
+  uint16_t handle;
+  uint16_t packet_len;                                    //multi_len when it started
+  uint32_t start_ticks;
+  uint8_t phy;                                            //PHY it ended on, for the throughput log
+} xfer;
+volatile uint8_t xfer_state = XFER_IDLE;
+uint32_t xfer_errors = 0;
+//A transfer asks for the 2M PHY, if the peer has it, and goes back to 1M when it's done. The timer is a
+//watchdog for a transfer that stops getting HVN_TX_COMPLETEs, it also keeps the RTC running for the throughput log.
+#define XFER_WATCHDOG_MS     60000
+APP_TIMER_DEF(m_xfer_timer);
+uint8_t conn_phy = BLE_GAP_PHY_1MBPS;                    //peripheral link TX PHY
+uint8_t phy_asked = 0, phy_2m_refused = 0;               //asked is 0 when nothing is pending
+static void phy_request(uint8_t phy);
+static void xfer_timeout_handler(void * p_context);
+static void xfer_log(void);
+//Connection parameter profiles, the main loop picks one from what the robot is doing and asks the central for it
+//through ble_conn_params. A profile the central turns down isn't asked for again on that connection.
+//Event length can't change on a live link, so NRF_SDH_BLE_GAP_EVENT_LENGTH covers a whole 7.5ms interval and
+//connection event extension lets bulk transfers keep going past it when the radio has nothing else to do.
+#define CONN_PROFILE_NORMAL  0                            //what gap_params_init asks for
+#define CONN_PROFILE_CONTROL 1                            //driving, answer commands fast
+#define CONN_PROFILE_BULK    2                            //transfers and Pi reads
+#define CONN_PROFILE_IDLE    3                            //no commands for CONN_IDLE_MS
+#define CONN_PROFILES        4
+#define CONN_IDLE_MS         20000
+static ble_gap_conn_params_t conn_profiles[CONN_PROFILES] = {
+  { MIN_CONN_INTERVAL, MAX_CONN_INTERVAL, SLAVE_LATENCY, CONN_SUP_TIMEOUT },
+  { MSEC_TO_UNITS(7.5, UNIT_1_25_MS), MSEC_TO_UNITS(20, UNIT_1_25_MS), 0, CONN_SUP_TIMEOUT },
+  { MSEC_TO_UNITS(7.5, UNIT_1_25_MS), MSEC_TO_UNITS(15, UNIT_1_25_MS), 0, CONN_SUP_TIMEOUT },
+  { MSEC_TO_UNITS(100, UNIT_1_25_MS), MSEC_TO_UNITS(200, UNIT_1_25_MS), 4, MSEC_TO_UNITS(6000, UNIT_10_MS) },
+};
+APP_TIMER_DEF(m_idle_timer);
+uint8_t conn_profile = CONN_PROFILE_NORMAL, conn_profile_refused = 0;   //refused is a bit per profile
+volatile uint8_t conn_idle = 0, conn_params_report = 0;
+uint16_t conn_interval = 0;                               //1.25ms units, what the central actually picked
+static void conn_profile_update(void);
+static void conn_activity(void);
+static void idle_timeout_handler(void * p_context);
+uint32_t xfer_start(void const * p_data, uint32_t len, uint16_t handle);
+void xfer_abort(void);
+static void xfer_pump(void);
 
 //Microphone, 16k is 1s of audio
+#if SMALL_SOUND_BUFFER
+#define SAMPLE_BUFFER_CNT 4*1024
+#else
 #define SAMPLE_BUFFER_CNT 16*1024
-int16_t p_rx_buffer[SAMPLE_BUFFER_CNT+6];    //+6 makes it 16,380/20=1638 20 byte packets
+#endif
+#if SMALL_SOUND_BUFFER == 0 && NRF_SDH_BLE_GATT_MAX_MTU_SIZE > BLE_GATT_ATT_MTU_DEFAULT
+#error "A large MTU and the 1s sound buffer don't both fit in RAM, see SMALL_SOUND_BUFFER"
+#endif
+__ALIGN(4) int16_t p_rx_buffer[SAMPLE_BUFFER_CNT+6];    //+6 makes 1s 32,780/20=1639 20 byte packets, aligned for fstorage
+int16_t const * p_sound = p_rx_buffer;       //what the BLE sound reads send, p_rx_buffer or a clip in flash
+uint32_t sound_len = SAMPLE_BUFFER_CNT;
+//Clip service. p_rx_buffer is also laid out as read only characteristics of 512 bytes each, the most an
+//attribute can be, with the value living in p_rx_buffer itself (VLOC_USER). A client does long reads on them
+//in order and gets the whole recording at whatever MTU it has, the softdevice reads the buffer directly, so
+//there is no copy and no authorize event per packet like the 128 byte characteristic has. Only RAM clips,
+//a clip in flash still goes out the old way and the slices read zero length until the next RAM clip.
+#define CLIP_SLICE_SAMPLES   256                          //512 bytes, one PDM stream block
+#define CLIP_SLICES          (SAMPLE_BUFFER_CNT / CLIP_SLICE_SAMPLES)
+uint16_t clip_svc_handle;
+ble_gatts_char_handles_t clip_slice_handles[CLIP_SLICES];
+static uint32_t add_clip_service(void);
+static void clip_slices_valid(uint8_t valid);
 uint8_t mic_gain = NRF_PDM_GAIN_DEFAULT;
 uint32_t load_buffer_offset = 0;
 volatile bool m_xfer_done = false;
 void configure_microphone(void);
-void audio_handler(nrf_drv_pdm_evt_t const * const evt);                //Just sets xfer_done
+void audio_handler(nrf_drv_pdm_evt_t const * const evt);                //sets xfer_done, or hands stream blocks on
+//Streaming, the PDM fills one small block while the last one gets processed in the PDM interrupt.
+//Whatever needs live sound sets its bit in mic_stream_users, the stream runs while any bit is set.
+//Recordings are stream blocks too, the PDM writes them in place in p_rx_buffer and the AGC and
+//everything else keep running on them.
+#define PDM_SAMPLE_RATE      16125.0f                     //1032kHz/64
+#define PDM_BLOCK_LEN        256                          //15.9ms per block
+#define MIC_USER_TONES       0x01
+#define MIC_USER_VAD         0x02
+#define MIC_USER_METER       0x04
+#define MIC_USER_RECORD      0x08
+#define MIC_USER_FLASH       0x10
+int16_t pdm_blocks[2][PDM_BLOCK_LEN];
+volatile uint8_t mic_streaming = 0;
+volatile uint8_t mic_isr_stop = 0;                        //PDM interrupt stopped the stream itself, don't hand out blocks
+uint8_t mic_stream_users = 0, mic_block_next = 0;
+void mic_stream_start(void);
+void mic_stream_stop(void);
+void mic_stream_update(void);
+static void audio_block_process(int16_t * p_block, uint16_t len);
+static int16_t * mic_next_block(void);
+static void block_levels(int16_t const * p_block, uint16_t len, q15_t * p_rms, uint16_t * p_peak);
+//Recording, 1s of blocks (1/4s with SMALL_SOUND_BUFFER) in order into p_rx_buffer, the PDM interrupt stops it after the last one
+uint8_t rec_write = 0;
+volatile uint8_t rec_done = 0;
+void record_start(void);
+void record_finish(void);
+static void clip_ready_pi(void);
+//AGC, keeps block rms near AGC_TARGET_RMS by moving the PDM gain between blocks, in the PDM's 0.5dB steps.
+//Turning down is fast (attack) so loud sounds don't clip for long, turning up is slow (release) so it
+//doesn't pump up the room noise between words. Until it has heard something a recording starts at the
+//maximum, like before the AGC, and the attack brings it down from there.
+#define AGC_TARGET_RMS       3000                         //about -21dBFS, leaves room for peaks
+#define AGC_WINDOW           6                            //+-3dB dead band
+#define AGC_ATTACK_STEPS     6                            //at most 3dB down per block
+#define AGC_CLIP_STEPS       12                           //6dB down when a block clips
+#define AGC_RELEASE_BLOCKS   4                            //0.5dB up every 4 blocks, ~8dB/s
+#define AGC_GATE_RMS         30                           //quieter than this is no signal, hold the gain
+#define AGC_DIGITAL_MAX      36                           //18dB, arm_scale_q15 with shift 3 tops out at 8x
+uint8_t agc_on = 1, agc_hold = 0, agc_digital = 0;        //agc_digital is 0.5dB steps on top of mic_gain
+uint8_t agc_heard = 0;                                    //a block over the gate has set the gain since it went on
+q15_t agc_scale = 0x1000;                                 //digital gain / 8, 0x1000 is 1.0
+static void agc_block(int16_t * p_block, uint16_t len);
+static void agc_set_gain(int32_t gain);
+static void agc_record_gain(void);
+//Flash recorder, for clips longer than RAM. Stream blocks go into a small staging ring and the main loop
+//queues each full one to nrf_fstorage. The ring is the start of p_rx_buffer, so a flash recording takes the
+//place of the RAM clip, RECORD_SOUND and the sound trigger wait until it's done. The whole region is erased before recording starts, erasing as it
+//goes can't keep up (85ms a page, 8 pages a second), writing alone is ~350ms of flash time per second.
+//The region sits under the FDS pages, the app's flash size in the project is cut down to match.
+#define FLASH_REC_START      0x64000
+#define FLASH_REC_END        0x7D000                      //FDS has 0x7D000-0x80000
+#define FLASH_PAGE_SIZE      0x1000
+#define FLASH_REC_PAGES      ((FLASH_REC_END - FLASH_REC_START) / FLASH_PAGE_SIZE)
+#define FLASH_BLOCK_BYTES    (PDM_BLOCK_LEN * sizeof(int16_t))
+#define FLASH_REC_BLOCKS     ((FLASH_REC_END - FLASH_REC_START) / FLASH_BLOCK_BYTES)   //200 blocks, ~3.2s
+#define FLASH_STAGE_BLOCKS   16                           //~250ms of slack for the flash to fall behind, 8KB
+STATIC_ASSERT(FLASH_STAGE_BLOCKS * PDM_BLOCK_LEN <= SAMPLE_BUFFER_CNT);
+#define FLASH_WRITES_MAX     4                            //writes queued at once, fds shares the queue
+#define FLASH_REC_IDLE       0
+#define FLASH_REC_ERASING    1
+#define FLASH_REC_ERASED     2                            //set by the fstorage event, main loop starts the stream
+#define FLASH_REC_RUN        3
+#define FLASH_REC_FLUSH      4                            //stream stopped, writes still going
+static void flash_rec_evt_handler(nrf_fstorage_evt_t * p_evt);
+NRF_FSTORAGE_DEF(nrf_fstorage_t m_fs_audio) =
+{
+    .evt_handler = flash_rec_evt_handler,
+    .start_addr  = FLASH_REC_START,
+    .end_addr    = FLASH_REC_END,
+};
+int16_t (* const flash_stage)[PDM_BLOCK_LEN] = (int16_t (*)[PDM_BLOCK_LEN])p_rx_buffer;
+volatile uint8_t flash_state = FLASH_REC_IDLE;
+volatile uint32_t flash_given, flash_filled, flash_queued, flash_written;   //block counts, only go up
+uint32_t flash_overruns = 0, flash_errors = 0;
+uint8_t flash_cancel = 0;                                 //stopped while still erasing
+void flash_rec_init(void);
+void flash_rec_start(void);
+void flash_rec_stop(void);
+void flash_rec_poll(void);
+static void flash_rec_block(int16_t const * p_block);
+//Filter stage, dc blocking high-pass then notches on the motor step rate and its harmonics, so sound
+//recorded while driving isn't all stepper whine. f32 biquads, DF2T, run in place on each block ahead
+//of everything else. start/stop_stepping_gpio flag a recompute, the PDM interrupt does it before the next block.
+#define FILTER_HPF_HZ        80.0f
+#define FILTER_NOTCHES       2                            //step rate and its 2nd harmonic
+#define FILTER_NOTCH_Q       5.0f                         //~250Hz wide at 1250Hz
+#define FILTER_STAGES        (1 + FILTER_NOTCHES)
+uint8_t filter_on = 1;
+volatile uint8_t filter_recompute = 1;
+volatile uint16_t filter_step_rate = 0;                   //Hz, 0 when the motors aren't stepping
+static arm_biquad_cascade_df2T_instance_f32 m_filter;
+static float32_t filter_coeffs[5*FILTER_STAGES];         //b0, b1, b2, a1, a2 per stage, CMSIS wants a1/a2 negated
+static float32_t filter_state[2*FILTER_STAGES];
+static float32_t filter_work[PDM_BLOCK_LEN];
+void filter_configure(void);
+static void filter_coefficients(void);
+static void filter_biquad(float32_t * p_coeffs, uint8_t highpass, float32_t freq, float32_t q);
+static void filter_block(int16_t * p_block, uint16_t len);
+//Sound triggered recording. While armed the PDM writes straight into p_rx_buffer, used as a ring of stream
+//blocks, so there is always the last second of sound in there. A cheap level/zero crossing check runs on each
+//block. When it trips, it records VAD_POST_BLOCKS more and stops, so the clip is pre-roll plus post-roll.
+//Then the ring is rotated to start at the oldest block and handed to the Pi like a RECORD_SOUND_PI.
+#define VAD_RING_BLOCKS      (SAMPLE_BUFFER_CNT / PDM_BLOCK_LEN)   //64 blocks, ~1s, 16 with SMALL_SOUND_BUFFER
+#define VAD_POST_BLOCKS      (VAD_RING_BLOCKS * 3 / 5)    //~600ms after the trigger, leaves ~400ms pre-roll
+#define VAD_HITS             2                            //loud blocks in a row to trip it
+#define VAD_RATIO            4                            //over the noise floor
+#define VAD_MIN_LEVEL        40                           //mean abs level, ignores a dead quiet room
+#define VAD_ZC_MAX           (PDM_BLOCK_LEN * 2 / 5)      //more zero crossings than this is hiss, not a sound
+#define VAD_OFF              0
+#define VAD_LISTEN           1
+#define VAD_POST             2
+#define VAD_FROZEN           3                            //PDM interrupt stopped it, main loop finishes up
+volatile uint8_t vad_state = VAD_OFF;
+uint8_t vad_write = 0, vad_hits = 0, vad_post = 0, vad_last_block = 0;
+uint16_t vad_blocks = 0;
+int32_t vad_noise = 0;                                    //noise floor, mean abs level << 4
+void vad_arm(uint8_t on);
+static void vad_block(int16_t const * p_block, uint16_t len);
+void vad_clip_ready(void);
+static void ring_rotate(int16_t * p_buf, uint32_t len, uint32_t first);
+//Level meter, to set mic_gain without downloading a recording. RMS, peak and clipped samples are taken
+//per block and rolled up every METER_BLOCKS, ~10 a second, into one 6 byte notify.
+#define METER_BLOCKS         6                            //~95ms
+#define METER_CLIP_LEVEL     32000                        //this close to full scale counts as clipped
+uint16_t meter_rms = 0, meter_peak = 0;
+uint8_t meter_clips = 0;
+volatile uint8_t meter_ready = 0;                         //set in the PDM interrupt, main loop sends it
+static void meter_block(int16_t const * p_block, uint16_t len);
+//Tone detector, a Goertzel filter per tone runs on each stream block. It is only a handful of multiplies
+//per sample per tone, a lot cheaper than an fft when you know what frequencies you're listening for.
+//Defaults are the boot chirp tones, so one robot can hear another start up or play them.
+#define TONE_CNT_MAX         4
+#define TONE_HITS            3                            //blocks in a row before it counts, ~48ms
+#define TONE_RATIO           0.25f                        //tone power over block power, a clean tone right on freq is 1.0
+#define TONE_MIN_LEVEL       100.0f                       //rms, below this it's silence
+struct tone_struct {
+  float32_t freq;                                         //0 is an unused slot
+  uint8_t cmd;                                            //command to run when heard, 0 just reports it
+};
+struct tone_struct tones[TONE_CNT_MAX] = { 4000.0, 0, 5000.0, 0, 6000.0, 0 };
+uint8_t tone_cnt = 3;
+static float32_t tone_coeff[TONE_CNT_MAX];
+static uint8_t tone_hits[TONE_CNT_MAX];
+volatile uint8_t tones_heard = 0;                         //bit per slot, set in the PDM interrupt, main loop reports them
+void tones_configure(void);
+static void tones_block(int16_t const * p_block, uint16_t len);
+void tones_report(void);
 //FFT defines
 #define FPU_EXCEPTION_MASK               0x0000009F                      //!< FPU exception mask used to clear exceptions in FPSCR register.
 #define FPU_FPSCR_REG_STACK_OFF          0x40                            //!< Offset of FPSCR register stacked during interrupt handling in FPU part stack.
-// We want to use 44100 Hz sampling rate to reach 22050Hz band. 128 (64 pairs) samples are used
-// in FFT calculation with result contains 64 bins (22050Hz/64bins -> ~344,5Hz per bin).
-#define FFT_TEST_SAMPLE_FREQ_HZ          44100.0f                        //!< Frequency of complex input samples.
-#define FFT_TEST_COMP_SAMPLES_LEN        128                             //!< Complex numbers input data array size. Correspond to FFT calculation this number must be power of two starting from 2^5 (2^4 pairs) with maximum value 2^13 (2^12 pairs).
-#define FFT_TEST_OUT_SAMPLES_LEN         (FFT_TEST_COMP_SAMPLES_LEN / 2) //!< Output array size.
-//#define SIGNALS_RESOLUTION               100.0f                          //!< Sine wave frequency and noise amplitude resolution. To count resolution as decimal places in number use this formula: resolution = 1/SIGNALS_RESOLUTION .
-//#define SINE_WAVE_FREQ_MAX               20000                           //!< Maximum frequency of generated sine wave.
-//#define NOISE_AMPLITUDE                  1                               //!< Amplitude of generated noise added to signal.
+// The microphone samples at 1032kHz/64 = 16125Hz. 64 real samples (every other sample, so 8062Hz) go
+// into a real FFT, which gives 32 unique bins (4031Hz/32bins -> ~126Hz per bin). A complex FFT of the
+// same 64 samples gives 64 bins, but the top half is only the mirror image of the bottom half.
+#define FFT_REAL_SAMPLES_LEN             64                              //!< Real input samples. Must be a power of two from 32 to 4096 for arm_rfft_fast_f32.
+#define FFT_TEST_OUT_SAMPLES_LEN         (FFT_REAL_SAMPLES_LEN / 2)      //!< Output array size, unique bins only.
+#define FFT_INPUT_START                  800                             //!< Where in the sound buffer the fft input starts.
 uint8_t send_dft = 0;
-static uint32_t  m_ifft_flag             = 0;                            //!< Flag that selects forward (0) or inverse (1) transform.
-static uint32_t  m_do_bit_reverse        = 1;                            //!< Flag that enables (1) or disables (0) bit reversal of output.
-#define FFT_TEST_COMP_SAMPLES_LEN        128    
-static float32_t m_fft_input_f32[FFT_TEST_COMP_SAMPLES_LEN];             //!< FFT input array. Time domain.
-static float32_t m_fft_output_f32[FFT_TEST_OUT_SAMPLES_LEN];             //!< FFT output data. Frequency domain.
+static uint8_t   m_ifft_flag             = 0;                            //!< Flag that selects forward (0) or inverse (1) transform.
+static arm_rfft_fast_instance_f32 m_rfft_f32;                            //!< Real FFT instance, set up once by configure_dft().
+static float32_t m_fft_input_f32[FFT_REAL_SAMPLES_LEN];                  //!< FFT input array. Time domain, real samples only.
+static float32_t m_fft_output_f32[FFT_REAL_SAMPLES_LEN];                 //!< FFT output data. Frequency domain, packed complex bins.
 static uint16_t p_out_buffer[FFT_TEST_OUT_SAMPLES_LEN];                  //transfer to pi or cellphone
+//Q15 spectrum, takes the int16 sound samples as is, no float conversion or FPU
+#define DFT_MODE_F32                     0
+#define DFT_MODE_Q15                     1
+uint8_t dft_mode = DFT_MODE_F32;                                         //selected at runtime with TOGGLE_DFT_Q15
+static arm_rfft_instance_q15 m_rfft_q15;                                 //!< Real FFT instance, q15
+static q15_t m_fft_input_q15[FFT_REAL_SAMPLES_LEN];                      //!< FFT input array, q15. Gets trashed by the fft.
+static q15_t m_fft_output_q15[FFT_REAL_SAMPLES_LEN*2];                   //!< arm_rfft_q15 writes out the mirrored half too
+void configure_dft(void);
+static void fpu_clear_exceptions(void);
+static void spectrum_f32(int16_t const * p_samples, uint32_t stride, arm_rfft_fast_instance_f32 * p_rfft,
+                         float32_t * p_work, float32_t * p_spectrum, uint16_t * p_out);
+static void spectrum_q15(int16_t const * p_samples, uint32_t stride, arm_rfft_instance_q15 const * p_rfft,
+                         q15_t * p_work, q15_t * p_spectrum, uint16_t * p_out);
+void dft_benchmark(void);
 void do_dft(void);
 void TxUART_DFT(void);
 
@@ -370,6 +905,7 @@ uint8_t timer1_enabled_for_motors = 0, step_loop_done = 0, turn_flag = 0, motor_
 uint32_t timer1_counter, timer1_match_value, timer1_toggle_step, timer_turn_step_count, timer_turn_match;
 uint32_t motors_speed = 1000;
 uint16_t timer1_turn_count = 0;
+volatile uint32_t step_count = 0;                        //steps since boot, for telemetry
 void motors_forward();
 void motors_backward(void);
 void motors_right(void);
@@ -388,26 +924,69 @@ void stop_stepping_gpio(void);
 uint8_t buzzer_loops_done = 1, song_playing = 0;
 void pwm_buzzer_frequency(float freq, uint32_t loops);
 void stop_buzzer(void);
-//This song feature isn't done
+//PCM playback through the buzzer. PWM1 runs at 16MHz with a top of 248, a 64.5kHz carrier the buzzer can't
+//follow, and each duty value is held for 4 periods (refresh 3), so samples go out at 16129Hz, right on the
+//mic rate. Two sequence buffers ping-pong, the PWM plays one while the SEQEND interrupt refills the other.
+//Sources are 16 bit clips, p_rx_buffer or flash, cut down to 8 bit duty cycles.
+#define PCM_TOP              248
+#define PCM_REFRESH          3
+#define PCM_SEQ_LEN          256                          //16ms per buffer
+#define BUZZER_TONE          0                            //pwm_buzzer_frequency, LOOPSDONE interrupt
+#define BUZZER_PCM           1                            //pcm playback, SEQEND interrupts
+uint8_t buzzer_mode = BUZZER_TONE;
+static uint16_t pcm_seq[2][PCM_SEQ_LEN];
+int16_t const * p_pcm16 = NULL;
+uint32_t pcm_len = 0, pcm_pos = 0;
+uint8_t pcm_tail = 0;                                     //silent refills since the sound ran out
+void pcm_play_clip(int16_t const * p_pcm, uint32_t len);
+void pcm_play_stop(void);
+static void pcm_start(void);
+static void pcm_fill(uint16_t * p_seq);
+static void pcm_seq_end(void);
+//Songs. A song is a list of notes, the PWM1 LOOPSDONE interrupt ends a note and starts the next one, so
+//nothing waits on the buzzer. Slot 0 is the boot jingle. Songs are built up over BLE a note at a time with
+//SONG_NOTE then kept with SONG_SAVE, which also writes them to FDS so they come back after a reset.
+#define SONG_SLOTS           4
+#define SONG_NOTES_MAX       32
+#define SONG_BOOT            0
+#define SONG_FILE_ID         0x5347                       //FDS file, record key is slot+1
+#define SONG_REST_FREQ       1000                         //rests play at 0 duty, this just sets the timing
 struct notes_struct {
-  float32_t freq;
-  uint16_t duration;
+  uint16_t freq;                                          //Hz, 0 is a rest
+  uint16_t ms;
 };
 struct song_struct {
-  uint16_t num_notes; 
-  struct notes_struct *notes;
-} song;
+  uint16_t num_notes;
+  uint16_t unused;                                        //keeps it a whole number of words for FDS
+  struct notes_struct notes[SONG_NOTES_MAX];
+};
+struct song_struct songs[SONG_SLOTS] = {
+  { 3, 0, { {4000, 100}, {5000, 80}, {6000, 67} } },    //the old 400 loop beeps
+};
+struct song_struct song_upload;
+struct song_struct const * p_song = NULL;
+volatile uint16_t song_note = 0;
+uint8_t song_repeat = 0;
+uint8_t song_fds_ready = 0;
+uint32_t song_fds_errors = 0;
+void song_play(uint8_t slot, uint8_t repeat);
+void song_stop(void);
+void song_save(uint8_t slot);
+void song_storage_init(void);
+static void song_next_note(void);
+static void song_fds_evt_handler(fds_evt_t const * p_evt);
+static void buzzer_tone(float32_t freq, uint32_t loops, uint8_t mute);
 
 //General
 void my_configure(void);
 void bb_test(void);
 void adhoc_robot_test(void);
+void cmd_queue_test(void);
 void mb_test(void);
 void led_off(void);
 void led_on(void);
 void rover(uint32_t freq, uint8_t dirmode);        //does current step mode
 static uint8_t range, distance, callonce;
-struct notes_struct basic[4] = { 440.0, 100, 470.0, 100, 2600.0, 200, 1000.0, 500 };
 
 //Entry point of firmware
 int main(void)
@@ -415,11 +994,8 @@ int main(void)
     uint8_t step_mode = n32_STEP, counter = 0, recording_flag=0, last_cmd=0;
     uint8_t photovore_mode=0, recording_flag_pi = 0;
     uint16_t lux_threshold;
-    uint32_t freq = motors_speed, steps = 200, i, ms_cnt;
+    uint32_t freq = motors_speed, steps = 200, i;
     float32_t ambient_value;
-    ret_code_t err_code;
-    song.num_notes = 3;
-    song.notes = basic;
  
     nrf_gpio_cfg_output(GREEN_LED);
     led_off();
@@ -430,6 +1006,12 @@ int main(void)
     uart_init();
     
     configure_microphone();
+    configure_dft();
+    tones_configure();
+    filter_configure();
+    #if DFT_BENCHMARK
+      dft_benchmark();
+    #endif
 
     #if SPARKFUN == 0
       configure_VLX6180();
@@ -441,32 +1023,31 @@ int main(void)
     // Initialize.
     timers_init();
     ble_stack_init();
+    flash_rec_init();
+    song_storage_init();              //boot jingle starts once FDS has loaded any saved songs
+    peer_manager_init();
     gap_params_init();
     gatt_init();
     services_init();
     advertising_init();
     conn_params_init();
     db_discovery_init();
-    advertising_start();
+    advertising_start(BLE_ADV_MODE_FAST);
 
     #if ADHOC_TEST
       adhoc_robot_test();
     #endif
+    #if CMD_QUEUE_TEST
+      cmd_queue_test();
+    #endif
     #if 0
     //SPARKFUN
       bb_test();
     #endif
 
-    //Show user robot is indeed on and ready
+    //Show user robot is indeed on and ready, the main loop turns the led off when the jingle is done
     led_on();                         
-    pwm_buzzer_frequency(4000.0, 400);    //higher frequencies are louder with this buzzer          
-    while(buzzer_loops_done == 0);
-    pwm_buzzer_frequency(5000.0, 400);              
-    while(buzzer_loops_done == 0);
     data_value = getDistance();           //call once to calibrate
-    pwm_buzzer_frequency(6000.0, 400);              
-    while(buzzer_loops_done == 0);
-    led_off();
     ambient_value = getAmbientLight(GAIN_1);  //call once to calibrate
 
     recording_flag = 0;
@@ -480,107 +1061,163 @@ int main(void)
     {
           //Trap here when BLE not connected
           callonce = 1;
-          while (BLE_P_Connected == 0)
+          while (BLE_P_Connected == 0 && swarm_follow == 0)
           {
             if (callonce == 1)
             {
               stop_buzzer();
+              song_stop();
+              pcm_play_stop();
               stop_stepping_gpio();
               motors_sleep();
+              vad_arm(0);
+              flash_rec_stop();
+              mic_stream_users = 0;
+              mic_stream_update();
               callonce = 0;
             }
-            nrf_delay_ms(200);      //BLE not connected robot heartbeat
-            led_on();
-            nrf_delay_ms(200);
-            led_off();
-            TxUART(teststr);
+            if (beacon_due == 1)
+              beacon_update();
+            if (sensor_due == 1)
+              sensor_poll();
+            if (heartbeat_due == 1)   //BLE not connected robot heartbeat
+            {
+              heartbeat_due = 0;
+              heartbeat_led ^= 1;
+              if (heartbeat_led == 1)
+              {
+                led_on();
+              }
+              else
+              {
+                led_off();
+                TxUART(teststr);
+              }
+            }
+            if (BLE_P_Connected == 0 && swarm_follow == 0 && beacon_due == 0 && sensor_due == 0 && heartbeat_due == 0)
+              power_manage();         //timers, radio events and UART wake it
+          }
+          if (tones_heard != 0)
+          {
+              tones_report();
+          }
+          if (vad_state == VAD_FROZEN)
+          {
+              vad_clip_ready();
+          }
+          if (flash_state != FLASH_REC_IDLE)
+          {
+              flash_rec_poll();
+          }
+          if (BLE_P_Connected == 1)
+          {
+              conn_profile_update();
+          }
+          if (frame_ack_pending == 1)
+          {
+              if (update_remote_frame_ack() != NRF_ERROR_RESOURCES)
+                frame_ack_pending = 0;    //one ack covers everything up to frame_seq_done
+          }
+          if (conn_params_report == 1)
+          {
+              conn_params_report = 0;
+              update_remote_event(EVENT_CONN, conn_profile, conn_interval);
+              sprintf(buf_out,"Connection profile %d, interval %d.%02d ms\r\n",conn_profile,
+                      (conn_interval * 125) / 100,(conn_interval * 125) % 100);
+              TxUART(buf_out);
+          }
+          if (meter_ready == 1)
+          {
+              meter_ready = 0;
+              update_remote_level();
+          }
+          if (stream_on == 1)
+          {
+              stream_pump();
+              if (stream_bulk_done == 1 && update_remote_event(EVENT_STREAM, stream_bulk.ch, stream_bulk.frames) != NRF_ERROR_RESOURCES)
+              {
+                stream_bulk_done = 0;
+                phy_request(BLE_GAP_PHY_1MBPS);
+                led_off();
+              }
+          }
+          if (beacon_due == 1)
+          {
+              beacon_update();
+          }
+          if (sensor_due == 1)
+          {
+              sensor_poll();
+          }
+          if (telem_due == TELEM_DUE)
+          {
+              telem_build(step_mode, freq);
+              telem_due = TELEM_BUILT;
+          }
+          if (telem_due == TELEM_BUILT)
+          {
+              if (update_remote_telem() != NRF_ERROR_RESOURCES)
+                telem_due = 0;            //otherwise the same record again next pass
           }
           if (send_dft == 1)
           {
               led_off();
               send_dft = 0;
- /*             data_value = 255;       //kind of a not good flag, say sending, 64 bytes, 3 packets 20, 1 padded packet of 4
-              update_remote_byte();
-              ms_cnt = 0;
-              i=0;
-              while(i<FFT_TEST_OUT_SAMPLES_LEN)    //this is tricky, uint16_t == 2 bytes * 10 = 20 bytes
+              if (stream_on == 1)
               {
-                  //This tough, assume 50Hz or every 20ms. It will take 5s to transfer 32k, if perfect
-                  err_code = update_remote_multi_byte_dft(i);
-                  if (err_code == NRF_ERROR_RESOURCES || err_code == NRF_ERROR_BUSY)
-                  {
-                    nrf_delay_ms(2);  //extra delay
-                    continue;
-                  }
-                  else
-                  {
-                    i+=MULTI_LEN/2;            //only increment is successful (assume)
-                  }
-                  nrf_delay_ms(19);   //cause slight overrun
-                  ++ms_cnt;
-                  if (!(ms_cnt % 20))
-                    led_off();
-                  if (!(ms_cnt % 40))
-                    led_on();
-               }
-               data_value = 127;       //kind of a not good flag
-               update_remote_byte(); 
-*/             TxUART_DFT();
+                stream_bulk_start(STREAM_CH_SPECTRUM, p_out_buffer, sizeof(p_out_buffer));
+              }
+              else if (xfer_state == XFER_IDLE)
+              {
+                data_value = 255;       //kind of a not good flag, say sending, 64 bytes, 3 packets 20, 1 padded packet of 4
+                update_remote_byte();
+                xfer_start(p_out_buffer, sizeof(p_out_buffer), data_128byte_handle.value_handle);
+              }
+              TxUART_DFT();
+          }
+          if (xfer_state == XFER_DONE)
+          {
+              data_value = 127;       //kind of a not good flag
+              if (update_remote_byte() != NRF_ERROR_RESOURCES)
+              {
+                xfer_state = XFER_IDLE;
+                xfer_log();
+                phy_request(BLE_GAP_PHY_1MBPS);
+                led_off();
+              }
           }
           if (recording_flag == 1)
           {
-            if (nrf_pdm_event_check(NRF_PDM_EVENT_END) == true)
+            if (rec_done == 1)
             {
               led_off();
               recording_flag = 0;
-              nrf_drv_pdm_stop();
-              data_value = 255;       //kind of a not good flag
-              update_remote_byte();
-              ms_cnt = 0;
-              i=0;
-              while(i<SAMPLE_BUFFER_CNT)    //this is tricky, int16_t == 2 bytes * 10 = 20 bytes
+              record_finish();
+              if (stream_on == 1)
               {
-                  //This tough, assume 50Hz or every 20ms. It will take 5s to transfer 32k, if perfect
-                  err_code = update_remote_multi_byte(i);
-                  if (err_code == NRF_ERROR_RESOURCES || err_code == NRF_ERROR_BUSY)
-                  {
-                    nrf_delay_ms(2);  //extra delay
-                    continue;
-                  }
-                  else
-                  {
-                    i+=MULTI_LEN/2;            //only increment is successful (assume)
-                  }
-                  nrf_delay_ms(19);   //cause slight overrun
-                  ++ms_cnt;
-                  if (!(ms_cnt % 20))
-                    led_off();
-                  if (!(ms_cnt % 40))
-                    led_on();
-               }
-               data_value = 127;       //kind of a not good flag
-               update_remote_byte();
+                stream_bulk_start(STREAM_CH_AUDIO, p_sound, sound_len * sizeof(int16_t));   //EVENT_STREAM when it's done
+              }
+              else
+              {
+                data_value = 255;       //kind of a not good flag
+                update_remote_byte();
+                xfer_start(p_sound, sound_len * sizeof(int16_t), data_128byte_handle.value_handle);   //127 when it's done
+              }
             }
           }
           if (recording_flag_pi == 1)
           {
-            if (nrf_pdm_event_check(NRF_PDM_EVENT_END) == true)
+            if (rec_done == 1)
             {
               led_off();
-              nrf_drv_pdm_stop();
-              load_buffer_offset = 0;
+              record_finish();
               recording_flag_pi = 0;
-              sound_flag.len = 1;                           //sound flag is a 1byte characteristic struct
-              data_value = 255;                             //recording done flag, tell Pi to start reading
-              sound_flag.p_value = &data_value;
-              sound_flag.offset = 0;
-              sd_ble_gatts_value_set(m_conn_p_handle,data_handle.value_handle,&sound_flag); //signal pi to start reading
-              pi_reads_active = 1;
+              clip_ready_pi();
             }
           }
           if (pi_reads_active == 1)
           {
-              if (load_buffer_offset >= SAMPLE_BUFFER_CNT-1)  //end of 10 uint16_t chunks of buffer
+              if (load_buffer_offset >= sound_len-1)  //end of 10 uint16_t chunks of buffer
               {
                 sound_flag.len = 1;
                 data_value = 127;                 //reading done flag, tell Pi
@@ -605,6 +1242,10 @@ int main(void)
               }
               update_remote_2byte();
           }
+          if (new_cmd == 0)
+          {
+            cmd_next();
+          }
           if (new_cmd == 1)
           {
             if (cmd_value != GET_DISTANCE && cmd_value != GET_AMBIENT)
@@ -834,39 +1475,153 @@ int main(void)
               TxUART(buf_out);
               break;
             case RECORD_SOUND:
+              if (flash_state != FLASH_REC_IDLE)
+                break;                          //p_rx_buffer is the flash recorder's staging ring
               data_value = 0;       //using data_value this way is not a good use for a flag
               update_remote_byte();
-              m_xfer_done = false;
               for(i=0;(i<SAMPLE_BUFFER_CNT);i++)
                 p_rx_buffer[i] = 0;
-              nrf_drv_pdm_buffer_set(p_rx_buffer, SAMPLE_BUFFER_CNT);
-              nrf_pdm_gain_set(NRF_PDM_GAIN_MAXIMUM,NRF_PDM_GAIN_MAXIMUM);
-              nrf_pdm_event_clear(NRF_PDM_EVENT_END);
               led_on();
-              nrf_drv_pdm_start();
+              record_start();                   //gain is whatever the AGC or INCREASE/DECREASE_GAIN left it at
               recording_flag = 1;
               break;
             case RECORD_SOUND_PI:
+              if (flash_state != FLASH_REC_IDLE)
+                break;
               sound_flag.len = 1;
               data_value = 0;                   //tell Pi recording, not ready to read yet
               sound_flag.p_value = &data_value;
               sound_flag.offset = 0;
               sd_ble_gatts_value_set(m_conn_p_handle,data_handle.value_handle,&sound_flag);
-              m_xfer_done = false;
               for(i=0;(i<SAMPLE_BUFFER_CNT);i++)
                 p_rx_buffer[i] = 0;
-              nrf_drv_pdm_buffer_set(p_rx_buffer, SAMPLE_BUFFER_CNT);
-              nrf_pdm_gain_set(NRF_PDM_GAIN_MAXIMUM,NRF_PDM_GAIN_MAXIMUM);
-              nrf_pdm_event_clear(NRF_PDM_EVENT_END);
               led_on();
-              nrf_drv_pdm_start();
+              record_start();                   //gain is whatever the AGC or INCREASE/DECREASE_GAIN left it at
               recording_flag_pi = 1;
               break;
+            case LISTEN_TONES:
+              mic_stream_users ^= MIC_USER_TONES;
+              mic_stream_update();
+              data_value = (mic_stream_users & MIC_USER_TONES) ? 1 : 0;
+              update_remote_byte();
+              break;
+            case SET_TONE:                      //speed 0 clears the slot, slot tone_cnt adds one
+              if (motors_code < TONE_CNT_MAX && motors_code <= tone_cnt && motors_speed < PDM_SAMPLE_RATE / 2)
+              {
+                tones[motors_code].freq = motors_speed;
+                tones[motors_code].cmd = 0;     //a new tone starts with no command, TONE_COMMAND sets one
+                if (motors_code == tone_cnt)
+                  ++tone_cnt;
+                tones_configure();
+              }
+              break;
+            case TONE_COMMAND:
+              if (motors_code < tone_cnt && motors_speed <= 0xFF)
+                tones[motors_code].cmd = (uint8_t)motors_speed;
+              break;
+            case VAD_RECORD:
+              if (vad_state == VAD_OFF && pi_reads_active == 0 && flash_state == FLASH_REC_IDLE)
+                vad_arm(1);
+              else
+                vad_arm(0);
+              data_value = (vad_state == VAD_OFF) ? 0 : 1;
+              update_remote_byte();
+              break;
+            case LEVEL_METER:
+              mic_stream_users ^= MIC_USER_METER;
+              mic_stream_update();
+              data_value = (mic_stream_users & MIC_USER_METER) ? 1 : 0;
+              update_remote_byte();
+              break;
             case DO_DFT:
               do_dft();   
               send_dft = 1;
               break;
+            case TOGGLE_DFT_Q15:
+              if (dft_mode == DFT_MODE_F32)
+                dft_mode = DFT_MODE_Q15;
+              else
+                dft_mode = DFT_MODE_F32;
+              data_value = dft_mode;
+              update_remote_byte();
+              break;
+            case AGC_TOGGLE:
+              agc_on ^= 1;
+              agc_heard = 0;
+              if (agc_on == 0)
+                agc_set_gain(mic_gain);         //drops any digital gain
+              data_value = agc_on;
+              update_remote_byte();
+              break;
+            case PLAY_CLIP:
+              if (buzzer_mode == BUZZER_PCM)
+                pcm_play_stop();
+              else
+                pcm_play_clip(p_sound, sound_len);
+              break;
+            case SONG_NOTE:
+              if (song_upload.num_notes < SONG_NOTES_MAX)
+              {
+                song_upload.notes[song_upload.num_notes].freq = motors_speed;
+                song_upload.notes[song_upload.num_notes].ms = (uint16_t)motors_code * 10;
+                ++song_upload.num_notes;
+              }
+              data_value = song_upload.num_notes;
+              update_remote_byte();
+              break;
+            case SONG_SAVE:
+              if (motors_code < SONG_SLOTS && song_upload.num_notes > 0)
+              {
+                if (p_song == &songs[motors_code])
+                  song_stop();
+                songs[motors_code] = song_upload;
+                song_save(motors_code);
+              }
+              song_upload.num_notes = 0;
+              break;
+            case PLAY_SONG:
+              if (song_playing == 1)
+                song_stop();
+              else if (motors_code < SONG_SLOTS)
+                song_play(motors_code, (motors_speed != 0) ? 1 : 0);
+              break;
+            case BEACON_RATE:
+              beacon_rate(motors_speed);
+              sprintf(buf_out,"Beacon every %d ms\r\n",beacon_period);
+              TxUART(buf_out);
+              break;
+            case TELEMETRY_RATE:
+              telem_rate(motors_speed);
+              sprintf(buf_out,"Telemetry every %d ms\r\n",telem_period);
+              TxUART(buf_out);
+              break;
+            case CMD_STATS:
+              update_remote_event(EVENT_QUEUE, cmd_depth_max, (uint16_t)cmd_dropped);
+              sprintf(buf_out,"cmds queued %lu run %lu dropped %lu\r\n",cmd_queued,cmd_run,cmd_dropped);
+              TxUART(buf_out);
+              sprintf(buf_out,"most waiting %d, bad frames %lu\r\n",cmd_depth_max,frame_errors);
+              TxUART(buf_out);
+              sprintf(buf_out,"stream frames dropped %lu, bad rx %lu\r\n",stream_drops,stream_rx_errors);
+              TxUART(buf_out);
+              sprintf(buf_out,"relay %d robots, mask %x, dropped %lu\r\n",relay_cnt,relay_mask,relay_dropped);
+              TxUART(buf_out);
+              sprintf(buf_out,"swarm seq %d, heard %lu\r\n",swarm_seq,swarm_heard);
+              TxUART(buf_out);
+              break;
+            case FLASH_RECORD:
+              if (flash_state == FLASH_REC_IDLE && pi_reads_active == 0 && (mic_stream_users & MIC_USER_RECORD) == 0)
+                flash_rec_start();
+              else
+                flash_rec_stop();
+              break;
+            case FILTER_TOGGLE:
+              filter_on ^= 1;
+              data_value = filter_on;
+              update_remote_byte();
+              break;
             case INCREASE_GAIN:
+              agc_on = 0;
+              agc_set_gain(mic_gain);
               mic_gain += 5;
               if (mic_gain > NRF_PDM_GAIN_MAXIMUM)
                 mic_gain = NRF_PDM_GAIN_MAXIMUM;
@@ -875,6 +1630,8 @@ int main(void)
               update_remote_byte();
               break;
             case DECREASE_GAIN:
+              agc_on = 0;
+              agc_set_gain(mic_gain);
               if (mic_gain < NRF_PDM_GAIN_MINIMUM+5)
                   mic_gain = NRF_PDM_GAIN_MINIMUM;
               else
@@ -884,36 +1641,55 @@ int main(void)
               update_remote_byte();
               break;
            case CONNECT_DISCONNECT:
-              if (BLE_C_Connected == 0)
-                scan_start();
-              else
-                err_code = sd_ble_gap_disconnect(m_conn_c_handle,BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+              relay_connect_disconnect();
+              break;
+           case BOND_MODE:
+              bond_mode_set(bond_mode ^ 1);
+              bond_armed = bond_mode;
+              data_value = bond_mode;
+              update_remote_byte();
+              break;
+           case SWARM_LEAD:
+              swarm_lead_set(swarm_lead ^ 1);
+              data_value = swarm_lead;
+              update_remote_byte();
+              break;
+           case SWARM_FOLLOW:
+              swarm_follow_set(swarm_follow ^ 1);
+              data_value = swarm_follow;
+              update_remote_byte();
+              break;
+           case RELAY_SELECT:
+              relay_mask = motors_code;
+              sprintf(buf_out,"Relay to %x\r\n",relay_mask);
+              TxUART(buf_out);
               break;
            default:
                break;
           }
-          if (BLE_C_Connected == 1)       //if connected forward command
+          if (BLE_C_Connected == 1 && cmd_stays_here(cmd_value) == 0)
+          {
+              relay_forward(cmd_value, cmd_args, motors_speed, motors_code);
+          }
+          if (swarm_lead == 1 && cmd_src != CMD_SRC_SWARM && cmd_stays_here(cmd_value) == 0)   //two leaders following each other would echo
           {
-              data_value = cmd_value;
-              ble_gattc_write_params_t params;
-              params.write_op = BLE_GATT_OP_WRITE_CMD;
-              params.flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE;
-              params.handle = remote_cmd_handle.value_handle;
-              params.offset = 0;
-              params.p_value = &data_value;
-              params.len = 1;
-              err_code = sd_ble_gattc_write(m_conn_c_handle,&params);	
+              swarm_broadcast(cmd_value, cmd_args, motors_speed, motors_code);
           }
           new_cmd = 0;
           last_cmd = cmd_value;
+          if (frame_running == 1)
+          {
+            frame_running = 0;
+            frame_seq_done = frame_seq_running;
+            frame_ack_pending = 1;
+          }
       }
       else
       {
-        if (recording_flag == 0 && recording_flag_pi == 0)
+        if (recording_flag == 0 && recording_flag_pi == 0 && song_playing == 0)
         {
           led_off();
         }
-        //play_song();
       }
    }  
 }
@@ -973,6 +1749,8 @@ void bb_test(void)
     start_stepping_gpio(100);
     while(1) 
     {
+       if (new_cmd == 0)
+         cmd_next();
        if (new_cmd == 1)
        {
           switch(cmd_value)
@@ -1002,6 +1780,123 @@ void bb_test(void)
     }
 }
 
+#if CMD_QUEUE_TEST
+//code carries a count per source, so anything lost, run twice or out of order shows up at cmd_next. The timer
+//interrupt stands in for on_write and the swarm reports, which put from the softdevice event interrupt.
+#define CQT_SOURCES          5                            //CMD_SRC_BYTE to CMD_SRC_SWARM
+#define CQT_ISR_BURST        6
+#define CQT_ISR_BURSTS       200
+APP_TIMER_DEF(m_cqt_timer);
+volatile uint8_t cqt_isr_seq = 0;
+volatile uint32_t cqt_isr_put = 0, cqt_isr_full = 0, cqt_isr_bursts = 0;
+
+static void cqt_timeout_handler(void * p_context)
+{
+    uint8_t i;
+
+    if (cqt_isr_bursts >= CQT_ISR_BURSTS)
+      return;
+    ++cqt_isr_bursts;
+    for(i=0;i<CQT_ISR_BURST;i++)
+    {
+      if (cmd_put(CMD_SRC_SWARM, 0, 0, 1, 0, cqt_isr_seq) == 1)
+      {
+        ++cqt_isr_seq;
+        ++cqt_isr_put;
+      }
+      else
+      {
+        ++cqt_isr_full;
+      }
+    }
+}
+
+//After the stack is up, the commands are only taken off the queue, not run
+void cmd_queue_test(void)
+{
+    uint8_t const main_srcs[3] = { CMD_SRC_BYTE, CMD_SRC_4BYTE, CMD_SRC_TONE };
+    uint8_t sent[CQT_SOURCES], expect[CQT_SOURCES], src, done;
+    uint32_t i, n, got, main_put, main_full, errors, dropped_before;
+    uint32_t speed_was = motors_speed;
+    uint8_t code_was = motors_code;
+    ret_code_t err_code;
+
+    TxUART("Command queue test\r\n");
+    //one burst from every source fills the queue, one more is dropped and counted
+    errors = 0;
+    memset(sent, 0, sizeof(sent));
+    memset(expect, 0, sizeof(expect));
+    for(i=0;i<CMD_QUEUE_LEN;i++)
+    {
+      src = i % CQT_SOURCES;
+      if (cmd_put(src, 0, 0, 1, i, sent[src]++) == 0)
+        ++errors;
+    }
+    dropped_before = cmd_dropped;
+    if (cmd_put(CMD_SRC_BYTE, 0, 0, 1, 0, 0) == 1 || cmd_dropped != dropped_before + 1)
+      ++errors;
+    for(i=0;cmd_next()==1;i++)
+    {
+      if (motors_speed != i || cmd_src != i % CQT_SOURCES || motors_code != expect[cmd_src]++)
+        ++errors;
+    }
+    if (i != CMD_QUEUE_LEN)
+      ++errors;
+    sprintf(buf_out,"Burst of %d, %lu out, %lu errors\r\n",CMD_QUEUE_LEN,i,errors);
+    TxUART(buf_out);
+
+    //main side puts and gets while the interrupt puts bursts
+    memset(sent, 0, sizeof(sent));
+    memset(expect, 0, sizeof(expect));
+    got = main_put = main_full = 0;
+    err_code = app_timer_create(&m_cqt_timer, APP_TIMER_MODE_REPEATED, cqt_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_start(m_cqt_timer, APP_TIMER_MIN_TIMEOUT_TICKS, NULL);
+    APP_ERROR_CHECK(err_code);
+    for(n=0;;n++)
+    {
+      if (cqt_isr_bursts < CQT_ISR_BURSTS)
+      {
+        src = main_srcs[n % 3];
+        if (cmd_put(src, 0, 0, 1, 0, sent[src]) == 1)
+        {
+          ++sent[src];
+          ++main_put;
+        }
+        else
+        {
+          ++main_full;
+        }
+      }
+      done = (cqt_isr_bursts >= CQT_ISR_BURSTS) ? 1 : 0;   //read first, the last burst lands before the drain
+      if (n % 4 == 0 || done == 1)
+      {
+        while (cmd_next() == 1)
+        {
+          if (cmd_src >= CQT_SOURCES || motors_code != expect[cmd_src])
+            ++errors;
+          expect[cmd_src % CQT_SOURCES] = motors_code + 1;
+          ++got;
+        }
+        if (done == 1)
+          break;
+      }
+    }
+    app_timer_stop(m_cqt_timer);
+    if (got != main_put + cqt_isr_put)
+      ++errors;
+    sprintf(buf_out,"Mixed %lu in, %lu out, %lu full, %lu errors, deepest %d\r\n",
+            main_put + cqt_isr_put,got,main_full + cqt_isr_full,errors,cmd_depth_max);
+    TxUART(buf_out);
+    TxUART(errors == 0 ? "Command queue test passed\r\n" : "Command queue test FAILED\r\n");
+
+    new_cmd = 0;
+    frame_running = 0;
+    motors_speed = speed_was;
+    motors_code = code_was;
+}
+#endif
+
 //Inherits stepping mode and freq from main()
 void rover(uint32_t freq, uint8_t rover_dir)
 {
@@ -1016,6 +1911,7 @@ void rover(uint32_t freq, uint8_t rover_dir)
   new_cmd = 0;
   while(new_cmd == 0)
   {
+      cmd_next();                       //any command stops it
       distance = getDistance();
       if (distance < 50)
       {
@@ -1037,19 +1933,136 @@ void rover(uint32_t freq, uint8_t rover_dir)
   return;
 }
 
-//This isn't done
-void play_song(void)
+void song_play(uint8_t slot, uint8_t repeat)
 {
-    static uint8_t i = 0;
+    if (songs[slot].num_notes == 0)
+      return;
+    song_stop();
+    pcm_play_stop();
+    p_song = &songs[slot];
+    song_repeat = repeat;
+    song_note = 0;
+    song_playing = 1;
+    song_next_note();
+}
 
+void song_stop(void)
+{
+    if (song_playing == 0)
+      return;
+    song_playing = 0;
     if (buzzer_loops_done == 0)
+    {
+      nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+      nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_STOP);
+      while(nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0);
+      buzzer_loops_done = 1;
+    }
+}
+
+//Called from song_play and then from PWM1_IRQHandler after each note
+static void song_next_note(void)
+{
+    struct notes_struct const * p_note;
+    float32_t freq;
+
+    if (song_note >= p_song->num_notes)
+    {
+      if (song_repeat == 0)
+      {
+        song_playing = 0;
+        return;
+      }
+      song_note = 0;
+    }
+    p_note = &p_song->notes[song_note++];
+    freq = (p_note->freq == 0) ? SONG_REST_FREQ : p_note->freq;
+    buzzer_tone(freq, (uint32_t)(freq * p_note->ms / 1000.0f), (p_note->freq == 0) ? 1 : 0);
+}
+
+void song_storage_init(void)
+{
+    ret_code_t err_code;
+
+    err_code = fds_register(song_fds_evt_handler);
+    APP_ERROR_CHECK(err_code);
+    err_code = fds_init();
+    APP_ERROR_CHECK(err_code);
+}
+
+//Writes over the slot's old record if there is one. Out of space runs garbage collection, which saves
+//it again when it's done.
+void song_save(uint8_t slot)
+{
+    fds_record_desc_t desc;
+    fds_find_token_t token;
+    fds_record_t record;
+    ret_code_t err_code;
+
+    if (song_fds_ready == 0)
       return;
+    memset(&token, 0, sizeof(token));
+    record.file_id = SONG_FILE_ID;
+    record.key = slot + 1;
+    record.data.p_data = &songs[slot];
+    record.data.length_words = sizeof(struct song_struct) / sizeof(uint32_t);
+    if (fds_record_find(SONG_FILE_ID, slot + 1, &desc, &token) == FDS_SUCCESS)
+      err_code = fds_record_update(&desc, &record);
+    else
+      err_code = fds_record_write(&desc, &record);
+    if (err_code == FDS_ERR_NO_SPACE_IN_FLASH)
+    {
+      TxUART("Song storage full, cleaning up\r\n");
+      fds_gc();
+    }
+    else if (err_code != FDS_SUCCESS)
+    {
+      ++song_fds_errors;
+    }
+}
 
-    pwm_buzzer_frequency(song.notes[i].freq,song.notes[i].duration);
-    if (i == song.num_notes-1)
-      i = 0;
-    else  
-      ++i;
+//Runs from the softdevice's SoC event interrupt, like the flash recorder's
+static void song_fds_evt_handler(fds_evt_t const * p_evt)
+{
+    fds_record_desc_t desc;
+    fds_find_token_t token;
+    fds_flash_record_t flash_record;
+    uint8_t slot;
+
+    if (p_evt->result != FDS_SUCCESS)
+      ++song_fds_errors;
+    switch (p_evt->id)
+    {
+      case FDS_EVT_INIT:
+        if (song_fds_ready == 1)
+          break;                        //the Peer Manager's fds_init after it's up sends INIT again
+        if (p_evt->result == FDS_SUCCESS)
+        {
+          song_fds_ready = 1;
+          for(slot=0;(slot<SONG_SLOTS);slot++)
+          {
+            memset(&token, 0, sizeof(token));
+            if (fds_record_find(SONG_FILE_ID, slot + 1, &desc, &token) != FDS_SUCCESS)
+              continue;
+            if (fds_record_open(&desc, &flash_record) != FDS_SUCCESS)
+              continue;
+            if (flash_record.p_header->length_words == sizeof(struct song_struct) / sizeof(uint32_t))
+              memcpy(&songs[slot], flash_record.p_data, sizeof(struct song_struct));
+            fds_record_close(&desc);
+          }
+        }
+        song_play(SONG_BOOT, 0);
+        break;
+      case FDS_EVT_GC:
+        for(slot=0;(slot<SONG_SLOTS);slot++)
+        {
+          if (songs[slot].num_notes > 0)
+            song_save(slot);
+        }
+        break;
+      default:
+        break;
+    }
 }
 
 //orphaned function, obsolete
@@ -1221,6 +2234,8 @@ void VLX6180_init(void)
 void stop_stepping_gpio(void)
 {
   nrf_timer_task_trigger(NRF_TIMER1,NRF_TIMER_TASK_STOP);
+  filter_step_rate = 0;
+  filter_recompute = 1;
 }
 
 void start_stepping_gpio(uint16_t freq)
@@ -1232,6 +2247,9 @@ void start_stepping_gpio(uint16_t freq)
   timer1_counter = 0;
   timer1_match_value = 2500 / freq;    //does 2 edges, so 5000/2 per sec
   timer1_enabled_for_motors = 1;
+  if (timer1_match_value != 0)
+    filter_step_rate = 2500 / timer1_match_value;    //actual step rate, 1000 asked for is 1250
+  filter_recompute = 1;                              //mic notches follow it
   nrf_timer_shorts_enable(NRF_TIMER1,NRF_TIMER_SHORT_COMPARE0_CLEAR_MASK);
   nrf_timer_task_trigger(NRF_TIMER1,NRF_TIMER_TASK_START);    
 }
@@ -1249,6 +2267,7 @@ void TIMER1_IRQHandler(void)
           nrf_gpio_pin_set(STEP);
           timer1_toggle_step = 0;
           ++timer1_turn_count;
+          ++step_count;
        }
        else
        {
@@ -1296,540 +2315,1952 @@ void twi_init(void)
 
 void audio_handler(nrf_drv_pdm_evt_t const * const evt)
 {
-   if (evt->buffer_requested == false)
+   if (mic_streaming == 0)
+   {
+     if (evt->buffer_requested == false)
        m_xfer_done = true;
+     return;
+   }
+   //released block is done filling, the PDM is already on the next one. A block released
+   //without a request is from a stop, it's only partly filled.
+   if (evt->buffer_released != NULL && evt->buffer_requested)
+     audio_block_process(evt->buffer_released, PDM_BLOCK_LEN);
+   if (evt->buffer_requested && mic_isr_stop == 0)
+     nrf_drv_pdm_buffer_set(mic_next_block(), PDM_BLOCK_LEN);
 }
 
-#if MOTORS_STEPPING_PWM
-//in common mode and refresh mode, number of steps should be even
-//wheels with tires travel approximately 1.67mm per step, so 300 steps is 5cm
-//a 90 degree turn should be 10 steps
-void pwm_motor_stepping(uint32_t steps_per_second, uint32_t number_steps)
+//Stream blocks go in order into p_rx_buffer when recording, round and round it when the sound
+//trigger is armed, otherwise the two small blocks
+static int16_t * mic_next_block(void)
 {
-  volatile static uint16_t pwm_duty[2];
-  volatile static uint32_t pwm_top;
-
-  pwm_top = 125000 / steps_per_second; 
-  if( pwm_top > 0xffff)
-    pwm_top = 0xffff;
-  pwm_duty[0] = pwm_duty[1] = pwm_top / 2;
+    int16_t * p_block;
 
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND0);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND1);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_STOPPED);
-  nrf_pwm_shorts_set(NRF_PWM0, NRF_PWM_SHORT_LOOPSDONE_SEQSTART0_MASK);
-  nrf_pwm_configure(NRF_PWM0,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,pwm_top);
-  nrf_pwm_seq_ptr_set(NRF_PWM0,0,pwm_duty);
-  nrf_pwm_seq_cnt_set(NRF_PWM0,0,1);
-  nrf_pwm_seq_ptr_set(NRF_PWM0,1,pwm_duty);
-  nrf_pwm_seq_cnt_set(NRF_PWM0,1,1);
-  nrf_pwm_loop_set(NRF_PWM0,number_steps / 2);
-  nrf_pwm_task_trigger(NRF_PWM0, NRF_PWM_TASK_SEQSTART0);
-  step_loop_done = 0;
+    if ((mic_stream_users & MIC_USER_RECORD) && rec_write < VAD_RING_BLOCKS)
+    {
+      p_block = &p_rx_buffer[rec_write * PDM_BLOCK_LEN];
+      ++rec_write;
+    }
+    else if (mic_stream_users & MIC_USER_FLASH)
+    {
+      if (flash_given < FLASH_REC_BLOCKS && flash_given - flash_written < FLASH_STAGE_BLOCKS)
+      {
+        p_block = flash_stage[flash_given % FLASH_STAGE_BLOCKS];
+        ++flash_given;
+      }
+      else
+      {
+        p_block = pdm_blocks[mic_block_next];   //flash fell behind, this block is lost
+        mic_block_next ^= 1;
+        if (flash_given < FLASH_REC_BLOCKS)
+          ++flash_overruns;
+      }
+    }
+    else if (mic_stream_users & MIC_USER_VAD)
+    {
+      p_block = &p_rx_buffer[vad_write * PDM_BLOCK_LEN];
+      if (++vad_write == VAD_RING_BLOCKS)
+        vad_write = 0;
+    }
+    else
+    {
+      p_block = pdm_blocks[mic_block_next];
+      mic_block_next ^= 1;
+    }
+    return p_block;
 }
 
-void PWM0_IRQHandler(void)
+//Runs in the PDM interrupt, has ~16ms before the next block shows up. Filters and AGC go first,
+//they change the block in place, so recordings get them too.
+static void audio_block_process(int16_t * p_block, uint16_t len)
 {
-    stop_stepping();
+    if (filter_on)
+      filter_block(p_block, len);
+    if (agc_on)
+      agc_block(p_block, len);
+    if ((mic_stream_users & MIC_USER_RECORD) && p_block == &p_rx_buffer[SAMPLE_BUFFER_CNT - PDM_BLOCK_LEN])
+    {
+      rec_done = 1;                           //last block of the recording, main loop sends it
+      mic_isr_stop = 1;
+      nrf_drv_pdm_stop();
+    }
+    if (mic_stream_users & MIC_USER_FLASH)
+      flash_rec_block(p_block);
+    if (mic_stream_users & MIC_USER_TONES)
+      tones_block(p_block, len);
+    if (vad_state == VAD_LISTEN || vad_state == VAD_POST)
+      vad_block(p_block, len);
+    if (mic_stream_users & MIC_USER_METER)
+      meter_block(p_block, len);
+    fpu_clear_exceptions();
 }
 
-void stop_stepping(void)
+void mic_stream_start(void)
 {
-  if (nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE))
-  {
-    nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);  
-    if (nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_STOPPED) == 0)
-    {
-        nrf_pwm_task_trigger(NRF_PWM0, NRF_PWM_TASK_STOP);
-        while(nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_STOPPED) == 0);
-        step_loop_done = 1;
-    }
-  }
+    if (mic_streaming == 1)
+      return;
+    while (nrf_drv_pdm_enable_check());       //a stop still finishing up, it's quick
+    mic_block_next = 0;
+    mic_isr_stop = 0;
+    mic_streaming = 1;
+    nrf_pdm_gain_set(mic_gain,mic_gain);
+    nrf_drv_pdm_start();                      //driver asks for the first buffer right away
 }
-#endif
 
-void PWM1_IRQHandler(void)
+void mic_stream_stop(void)
 {
-    stop_buzzer();
+    if (mic_streaming == 0)
+      return;
+    mic_streaming = 0;
+    nrf_drv_pdm_stop();
+    while (nrf_drv_pdm_enable_check());       //wait for STOPPED so a recording can have the PDM
 }
-//125000/freq=    125000/250
-void pwm_buzzer_frequency(float32_t freq, uint32_t loops)
+
+//Starts or stops the stream to match mic_stream_users
+void mic_stream_update(void)
 {
-  float32_t main_freq;
-  volatile static uint16_t pwm_top, pwm_duty[2];
-   
-  main_freq = 125000.0 / freq;
+    if (mic_stream_users == 0)
+      mic_stream_stop();
+    else
+      mic_stream_start();
+}
 
-  pwm_top = (uint16_t)main_freq;
-  pwm_duty[0] = pwm_duty[1] = (uint16_t)(main_freq / 2.0);
+void record_start(void)
+{
+    vad_arm(0);                               //both want p_rx_buffer
+    xfer_abort();                             //and so does sending the last recording
+    phy_request(BLE_GAP_PHY_1MBPS);
+    mic_stream_stop();                        //restart so the first block is the start of the buffer
+    agc_record_gain();
+    rec_write = 0;
+    rec_done = 0;
+    mic_stream_users |= MIC_USER_RECORD;
+    mic_stream_update();
+}
 
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
-  nrf_pwm_shorts_set(NRF_PWM1, NRF_PWM_SHORT_LOOPSDONE_SEQSTART0_MASK);
-  nrf_pwm_configure(NRF_PWM1,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,pwm_top);
-  nrf_pwm_seq_ptr_set(NRF_PWM1,0,pwm_duty);
-  nrf_pwm_seq_cnt_set(NRF_PWM1,0,1);
-  nrf_pwm_seq_ptr_set(NRF_PWM1,1,pwm_duty);
-  nrf_pwm_seq_cnt_set(NRF_PWM1,1,1);
-  nrf_pwm_loop_set(NRF_PWM1,loops / 2);
-  nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_SEQSTART0);
-  buzzer_loops_done = 0;
+void record_finish(void)
+{
+    mic_stream_users &= ~MIC_USER_RECORD;
+    mic_stream_stop();
+    rec_done = 0;
+    mic_stream_update();                      //back to just the other users, if any
+    p_sound = p_rx_buffer;
+    sound_len = SAMPLE_BUFFER_CNT;
+    clip_slices_valid(1);
 }
 
-//just toggles gpios for now
-void mb_test(void)
+//p_sound/sound_len is a finished clip. With the stream on it goes out on STREAM_CH_AUDIO and EVENT_STREAM
+//says it's all there, otherwise 255 on data_handle tells the Pi to start its reads, and 127 when it's done.
+static void clip_ready_pi(void)
 {
-  static uint8_t range;
+    if (stream_on == 1 && stream_bulk_start(STREAM_CH_AUDIO, p_sound, sound_len * sizeof(int16_t)) == NRF_SUCCESS)
+      return;
+    load_buffer_offset = 0;
+    sound_flag.len = 1;                           //sound flag is a 1byte characteristic struct
+    data_value = 255;                             //recording done flag, tell Pi to start reading
+    sound_flag.p_value = &data_value;
+    sound_flag.offset = 0;
+    sd_ble_gatts_value_set(m_conn_p_handle,data_handle.value_handle,&sound_flag); //signal pi to start reading
+    pi_reads_active = 1;
+}
 
-  nrf_gpio_cfg_output(MIC_CLK);
-  nrf_gpio_cfg_output(MIC_DI);
-  nrf_gpio_cfg_output(SLEEP);
-  
-  for(;;)
-  {
-    led_on();
-    nrf_gpio_pin_clear(STEP);
-    nrf_gpio_pin_clear(DIR_L);
-    nrf_gpio_pin_clear(DIR_R);
-    nrf_gpio_pin_clear(M1);
-    nrf_gpio_pin_clear(M0);
-    nrf_gpio_pin_clear(MIC_CLK);
-    nrf_gpio_pin_clear(MIC_DI);
-    nrf_gpio_pin_clear(SLEEP);
-    nrf_delay_ms(500);
-    led_off();
-    nrf_gpio_pin_set(STEP);
-    nrf_gpio_pin_set(DIR_L);
-    nrf_gpio_pin_set(DIR_R);
-    nrf_gpio_pin_set(M1);
-    nrf_gpio_pin_set(M0);
-    nrf_gpio_pin_set(MIC_CLK);
-    nrf_gpio_pin_set(MIC_DI);
-    nrf_gpio_pin_set(SLEEP);
-    nrf_delay_ms(500);
-    range = getDistance();
-    sprintf(buf_out,"Range is %d\r\n",range);
-    TxUART(buf_out);
+void flash_rec_init(void)
+{
+    ret_code_t err_code;
 
-    nrf_delay_ms(500);
-  }
+    err_code = nrf_fstorage_init(&m_fs_audio, &nrf_fstorage_sd, NULL);
+    APP_ERROR_CHECK(err_code);
 }
 
-void stop_buzzer(void)
+//Runs from the softdevice's SoC event interrupt
+static void flash_rec_evt_handler(nrf_fstorage_evt_t * p_evt)
 {
-  if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE))
-  {
-    nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);  
-    if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0)
+    if (p_evt->result != NRF_SUCCESS)
+      ++flash_errors;
+    switch (p_evt->id)
     {
-        nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_STOP);
-        while(nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0);
-        buzzer_loops_done = 1;
+      case NRF_FSTORAGE_EVT_WRITE_RESULT:
+        ++flash_written;
+        break;
+      case NRF_FSTORAGE_EVT_ERASE_RESULT:
+        flash_state = FLASH_REC_ERASED;
+        break;
+      default:
+        break;
     }
-  }
 }
 
-void uart_init(void)
+//Erase first, the stream starts from flash_rec_poll when the erase is done, ~2s later
+void flash_rec_start(void)
 {
-  nrf_uarte_baudrate_set(NRF_UARTE0,NRF_UARTE_BAUDRATE_115200); 
-  nrf_uarte_txrx_pins_set(NRF_UARTE0,UART_TX_PIN,UART_RX_PIN);
-  nrf_uarte_configure(NRF_UARTE0,NRF_UARTE_PARITY_EXCLUDED,NRF_UARTE_HWFC_DISABLED);  //no parity, no hw flow control
-  nrf_uarte_rx_buffer_set(NRF_UARTE0,buf_in,UART_LEN_LIMIT);
-  nrf_uarte_tx_buffer_set(NRF_UARTE0,buf_out,UART_LEN_LIMIT);
-  nrf_uarte_enable(NRF_UARTE0);
+    ret_code_t err_code;
+
+    vad_arm(0);                               //the staging ring is in p_rx_buffer
+    xfer_abort();                             //and so is the last recording it might be sending
+    err_code = nrf_fstorage_erase(&m_fs_audio, FLASH_REC_START, FLASH_REC_PAGES, NULL);
+    if (err_code != NRF_SUCCESS)
+    {
+      TxUART("Flash erase busy\r\n");
+      return;
+    }
+    flash_cancel = 0;
+    flash_state = FLASH_REC_ERASING;
+    update_remote_event(EVENT_FLASH, 0, FLASH_REC_PAGES);
 }
 
-void my_configure(void)
+void flash_rec_stop(void)
 {
-  nrf_gpio_cfg_output(DIR_L);
-  nrf_gpio_cfg_output(DIR_R);
-  nrf_gpio_cfg_output(SLEEP);
-  motors_sleep();               
-  motors_forward();
-  stepping_mode(HALF_STEP);         
-
-  nrf_gpio_pin_clear(STEP);
-  nrf_gpio_cfg_output(STEP);
+    if (flash_state == FLASH_REC_ERASING || flash_state == FLASH_REC_ERASED)
+      flash_cancel = 1;
+    if (flash_state == FLASH_REC_RUN)
+    {
+      mic_stream_users &= ~MIC_USER_FLASH;
+      mic_stream_stop();
+      flash_state = FLASH_REC_FLUSH;
+      mic_stream_update();
+    }
+}
 
-#if MOTORS_STEPPING_PWM
-  NRF_PWM0->PSEL.OUT[0] = STEP;
+//PDM interrupt side, counts the full staging blocks, stops the stream when the region is full
+static void flash_rec_block(int16_t const * p_block)
+{
+    if (p_block < flash_stage[0] || p_block > flash_stage[FLASH_STAGE_BLOCKS-1])
+      return;                                 //a lost block, see mic_next_block
+    ++flash_filled;
+    if (flash_filled == FLASH_REC_BLOCKS)
+    {
+      mic_isr_stop = 1;
+      nrf_drv_pdm_stop();
+      flash_state = FLASH_REC_FLUSH;
+    }
+}
 
-  nrf_pwm_enable(NRF_PWM0);
-  nrf_pwm_configure(NRF_PWM0,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,1000);
-  nrf_pwm_loop_set(NRF_PWM0,0);
-  nrf_pwm_decoder_set(NRF_PWM0,PWM_DECODER_LOAD_Common,PWM_DECODER_MODE_RefreshCount);
-  nrf_pwm_seq_refresh_set(NRF_PWM0,0,0);
-  nrf_pwm_seq_end_delay_set(NRF_PWM0,0,0);
-  nrf_pwm_seq_refresh_set(NRF_PWM0,1,0);
-  nrf_pwm_seq_end_delay_set(NRF_PWM0,1,0);
-  nrf_pwm_shorts_set(NRF_PWM0, 0);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND0);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND1);
-  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_STOPPED);
-  nrf_pwm_int_set(NRF_PWM0, NRF_PWM_INT_LOOPSDONE_MASK);
-  nrf_drv_common_irq_enable(PWM0_IRQn,APP_IRQ_PRIORITY_LOWEST);
-#else
-  //use gpio STEP and timer1
-  nrf_timer_event_clear(NRF_TIMER1,NRF_TIMER_EVENT_COMPARE0);
-  nrf_timer_mode_set(NRF_TIMER1,NRF_TIMER_MODE_TIMER);
-  nrf_timer_bit_width_set(NRF_TIMER1,NRF_TIMER_BIT_WIDTH_32);
-  nrf_timer_frequency_set(NRF_TIMER1,NRF_TIMER_FREQ_125kHz);
-  nrf_timer_cc_write(NRF_TIMER1,NRF_TIMER_CC_CHANNEL0,25);        // 200us per interrupt
-  nrf_timer_int_enable(NRF_TIMER1,NRF_TIMER_INT_COMPARE0_MASK);
-  nrf_drv_common_irq_enable(TIMER1_IRQn,APP_IRQ_PRIORITY_LOWEST);
-#endif
+//Main loop side, starts the stream after the erase, keeps the fstorage queue fed, and hands
+//the clip to the Pi when the last write is done
+void flash_rec_poll(void)
+{
+    ret_code_t err_code;
 
-  nrf_gpio_pin_clear(BUZZER_10MM);
-  nrf_gpio_cfg_output(BUZZER_10MM);
-  NRF_PWM1->PSEL.OUT[0] = BUZZER_10MM;
+    if (flash_state == FLASH_REC_ERASED && flash_cancel == 1)
+    {
+      flash_state = FLASH_REC_IDLE;
+      return;
+    }
+    if (flash_state == FLASH_REC_ERASED)
+    {
+      flash_given = flash_filled = flash_queued = flash_written = 0;
+      flash_overruns = flash_errors = 0;
+      mic_stream_stop();
+      agc_record_gain();
+      clip_slices_valid(0);                   //the staging ring is about to write over the RAM clip
+      mic_stream_users |= MIC_USER_FLASH;
+      flash_state = FLASH_REC_RUN;
+      mic_stream_update();
+      update_remote_event(EVENT_FLASH, 1, FLASH_REC_BLOCKS);
+      return;
+    }
+    while (flash_queued < flash_filled && flash_queued - flash_written < FLASH_WRITES_MAX)
+    {
+      err_code = nrf_fstorage_write(&m_fs_audio, FLASH_REC_START + flash_queued * FLASH_BLOCK_BYTES,
+                                    flash_stage[flash_queued % FLASH_STAGE_BLOCKS], FLASH_BLOCK_BYTES, NULL);
+      if (err_code != NRF_SUCCESS)
+        break;                                //queue full, try next time around
+      ++flash_queued;
+    }
+    if (flash_state == FLASH_REC_FLUSH && flash_written == flash_filled)
+    {
+      mic_stream_users &= ~MIC_USER_FLASH;
+      mic_stream_stop();                      //already stopped if the region filled up
+      mic_stream_update();
+      flash_state = FLASH_REC_IDLE;
+      p_sound = (int16_t const *)FLASH_REC_START;     //flash is memory mapped, reads come straight from it
+      sound_len = flash_filled * PDM_BLOCK_LEN;
+      clip_ready_pi();                        //same as RECORD_SOUND_PI from here
+      update_remote_event(EVENT_FLASH, 2, flash_filled);
+      sprintf(buf_out,"Flash clip %lu blocks, %lu lost, %lu errors\r\n",flash_filled,flash_overruns,flash_errors);
+      TxUART(buf_out);
+    }
+}
 
-  nrf_pwm_enable(NRF_PWM1);
-  nrf_pwm_configure(NRF_PWM1,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,1000);
-  nrf_pwm_loop_set(NRF_PWM1,0);
-  nrf_pwm_decoder_set(NRF_PWM1,PWM_DECODER_LOAD_Common,PWM_DECODER_MODE_RefreshCount);
-  nrf_pwm_seq_refresh_set(NRF_PWM1,0,0);
-  nrf_pwm_seq_end_delay_set(NRF_PWM1,0,0);
-  nrf_pwm_seq_refresh_set(NRF_PWM1,1,0);
-  nrf_pwm_seq_end_delay_set(NRF_PWM1,1,0);
-  nrf_pwm_shorts_set(NRF_PWM1, 0);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
-  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
-  nrf_pwm_int_set(NRF_PWM1, NRF_PWM_INT_LOOPSDONE_MASK);
-  nrf_drv_common_irq_enable(PWM1_IRQn,APP_IRQ_PRIORITY_LOWEST);
+//Block rms and peak from CMSIS. Peak uses min for the negative side so the block isn't written.
+static void block_levels(int16_t const * p_block, uint16_t len, q15_t * p_rms, uint16_t * p_peak)
+{
+    q15_t max_value, min_value;
+    uint32_t index;
+
+    arm_rms_q15((q15_t *)p_block, len, p_rms);
+    arm_max_q15((q15_t *)p_block, len, &max_value, &index);
+    arm_min_q15((q15_t *)p_block, len, &min_value, &index);
+    *p_peak = (max_value > 0) ? max_value : 0;
+    if (-(int32_t)min_value > *p_peak)
+      *p_peak = (min_value == -32768) ? 0x7fff : -min_value;
 }
 
-//expects null terminated string, so use sprintf for buf
-void TxUART(uint8_t* sendbuffer)
+//Level error is worked out in 0.5dB steps, 40*log10 of the amplitude ratio, and includes the digital
+//gain that's about to go on this block. A gain change shows up from the next block on.
+static void agc_block(int16_t * p_block, uint16_t len)
 {
-    uint8_t j;
+    q15_t rms;
+    uint16_t peak;
+    int32_t step = 0;
+    float32_t err;
 
-    j=0;
-    while(sendbuffer[j] != 0)
+    block_levels(p_block, len, &rms, &peak);
+    if (rms >= AGC_GATE_RMS)
     {
-        ++j;
-        if (j > UART_LEN_LIMIT)
+      agc_heard = 1;
+      err = 40.0f * log10f((float32_t)AGC_TARGET_RMS / rms) - agc_digital;
+      if (peak >= METER_CLIP_LEVEL || (((uint32_t)peak * agc_scale) >> 12) >= METER_CLIP_LEVEL)
+      {
+        step = -AGC_CLIP_STEPS;
+      }
+      else if (err < -AGC_WINDOW)
+      {
+        step = (err < -AGC_ATTACK_STEPS) ? -AGC_ATTACK_STEPS : (int32_t)err;
+      }
+      else if (err > AGC_WINDOW)
+      {
+        if (++agc_hold >= AGC_RELEASE_BLOCKS)
         {
-          j = UART_LEN_LIMIT;
-          break;
+          step = 1;
+          agc_hold = 0;
         }
+      }
+      else
+      {
+        agc_hold = 0;
+      }
+      if (step != 0)
+        agc_set_gain((int32_t)mic_gain + agc_digital + step);
     }
-    nrf_uarte_tx_buffer_set(NRF_UARTE0,sendbuffer,j);
-    nrf_uarte_event_clear(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX);
-    nrf_uarte_task_trigger(NRF_UARTE0,NRF_UARTE_TASK_STARTTX);
-    while( nrf_uarte_event_check(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX) == 0);   //This blocks on transmit, maybe fix for parallelism
-    nrf_uarte_event_clear(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX);
+    if (agc_digital != 0)
+      arm_scale_q15(p_block, agc_scale, 3, p_block, len);
 }
 
-void TxUART_DFT(void)
-{
-  uint8_t i;
- 
-  for(i=0;(i<FFT_TEST_OUT_SAMPLES_LEN);i++)
-  {
-      sprintf(buf_out,"%d,",p_out_buffer[i]);
-      TxUART(buf_out);
-  }
-  TxUART("\r\n");
-}
-/**
- * @brief Function for processing generated sine wave samples.
- * @param[in] p_input        Pointer to input data array with complex number samples in time domain.
- * @param[in] p_input_struct Pointer to cfft instance structure describing input data.
- * @param[out] p_output      Pointer to processed data (bins) array in frequency domain.
- * @param[in] output_size    Processed data array size.
- */
-static void fft_process(float32_t *                   p_input,
-                        const arm_cfft_instance_f32 * p_input_struct,
-                        float32_t *                   p_output,
-                        uint16_t                      output_size)
+//Start of a recording. With no history the AGC would start from NRF_PDM_GAIN_DEFAULT and take seconds to
+//release up, so it starts where RECORD_SOUND always did. With the AGC off the gain is the user's.
+static void agc_record_gain(void)
 {
-    // Use CFFT module to process the data.
-    arm_cfft_f32(p_input_struct, p_input, m_ifft_flag, m_do_bit_reverse);
-    // Calculate the magnitude at each bin using Complex Magnitude Module function.
-    arm_cmplx_mag_f32(p_input, p_output, output_size);
+    if (agc_on == 1 && agc_heard == 0)
+      agc_set_gain(NRF_PDM_GAIN_MAXIMUM);
 }
 
-//coming into fft, input sample with be 1 second of mono, or 16,000 int16_t values. The fft takes only 64
-//inputs from this. I will start in the middle, like at 800.
-//The input of the fft is 64 sound values, plus "fake" imaginary of 0 degrees, for 64 pairs, or 128 floats.
-//The output is 128, but these are duplicated symetrically, so only first 64 are useful.
-void do_dft(void)
+//gain is mic_gain plus digital, the PDM takes as much as it can and digital does the rest
+static void agc_set_gain(int32_t gain)
 {
-    uint32_t i;
-    uint32_t  max_val_index;
-    float32_t max_value, normal_value;
-
-    //Make 64 complex numbers from center of sound file
-    for(i=0;(i<FFT_TEST_COMP_SAMPLES_LEN);i+=2)
+    if (gain < NRF_PDM_GAIN_MINIMUM)
+      gain = NRF_PDM_GAIN_MINIMUM;
+#if AGC_DIGITAL
+    if (gain > NRF_PDM_GAIN_MAXIMUM + AGC_DIGITAL_MAX)
+      gain = NRF_PDM_GAIN_MAXIMUM + AGC_DIGITAL_MAX;
+#else
+    if (gain > NRF_PDM_GAIN_MAXIMUM)
+      gain = NRF_PDM_GAIN_MAXIMUM;
+#endif
+    if (gain > NRF_PDM_GAIN_MAXIMUM)
+    {
+      mic_gain = NRF_PDM_GAIN_MAXIMUM;
+      agc_digital = gain - NRF_PDM_GAIN_MAXIMUM;
+    }
+    else
     {
-          m_fft_input_f32[i] = p_rx_buffer[i+800];      //magnitude part 
-          m_fft_input_f32[i+1] = 0;                     //fake 0 degrees imaginary part             
+      mic_gain = gain;
+      agc_digital = 0;
     }
+    agc_scale = (q15_t)(4096.0f * powf(10.0f, agc_digital / 40.0f));
+    nrf_pdm_gain_set(mic_gain,mic_gain);
+}
 
-    // Process generated data. 64 pairs of complex data (real, img). It is important to use
-    // proper arm_cfft_sR_f32 structure associated with input/output data length.
-    // For example:
-    //  - 128 numbers in input array (64 complex pairs of samples) -> 64 output bins power data -> &arm_cfft_sR_f32_len64.
-    //  - 256 numbers in input array (128 complex pairs of samples) -> 128 output bins power data -> &arm_cfft_sR_f32_len128.
-    fft_process(m_fft_input_f32,
-                &arm_cfft_sR_f32_len64,
-                m_fft_output_f32,
-                FFT_TEST_OUT_SAMPLES_LEN);
- 
-    //zap dc component
-    m_fft_output_f32[0] = 0;
+void filter_configure(void)
+{
+    filter_coefficients();
+    arm_biquad_cascade_df2T_init_f32(&m_filter, FILTER_STAGES, filter_coeffs, filter_state);
+}
 
-    // Search FFT max value in input array.
-    arm_max_f32(m_fft_output_f32, FFT_TEST_OUT_SAMPLES_LEN, &max_value, &max_val_index);
- 
-    normal_value = max_value / 0x7fff;
+//Stage 0 is the high-pass, the rest are notches on step rate harmonics. A notch with nothing to do,
+//motors stopped or the harmonic too close to Nyquist, is a pass through.
+static void filter_coefficients(void)
+{
+    uint8_t h;
+    float32_t freq;
 
-    for(i=0;(i<FFT_TEST_OUT_SAMPLES_LEN);i++)
+    filter_recompute = 0;
+    filter_biquad(&filter_coeffs[0], 1, FILTER_HPF_HZ, 0.707f);
+    for(h=1;(h<=FILTER_NOTCHES);h++)
     {
-          //normalize value and assign          
-          p_out_buffer[i] = (uint16_t)(m_fft_output_f32[i] / normal_value);         
-    }
+      freq = (float32_t)filter_step_rate * h;
+      if (freq == 0 || freq > 0.45f * PDM_SAMPLE_RATE)
+      {
+        memset(&filter_coeffs[5*h], 0, 5 * sizeof(float32_t));
+        filter_coeffs[5*h] = 1.0f;
+      }
+      else
+      {
+        filter_biquad(&filter_coeffs[5*h], 0, freq, FILTER_NOTCH_Q);
+      }
+    }
+}
 
-#ifndef FPU_INTERRUPT_MODE
-        /* Clear FPSCR register and clear pending FPU interrupts. This code is base on
-         * nRF5x_release_notes.txt in documentation folder. It is necessary part of code when
-         * application using power saving mode and after handling FPU errors in polling mode.
-         */
-        __set_FPSCR(__get_FPSCR() & ~(FPU_EXCEPTION_MASK));
-        (void) __get_FPSCR();
-        NVIC_ClearPendingIRQ(FPU_IRQn);
-#endif
+//RBJ audio eq cookbook high-pass or notch, normalized by a0
+static void filter_biquad(float32_t * p_coeffs, uint8_t highpass, float32_t freq, float32_t q)
+{
+    float32_t w0, cos_w0, alpha, a0;
 
+    w0 = 2.0f * PI * freq / PDM_SAMPLE_RATE;
+    cos_w0 = arm_cos_f32(w0);
+    alpha = arm_sin_f32(w0) / (2.0f * q);
+    a0 = 1.0f + alpha;
+    if (highpass)
+    {
+      p_coeffs[0] = (1.0f + cos_w0) / 2.0f / a0;
+      p_coeffs[1] = -(1.0f + cos_w0) / a0;
+      p_coeffs[2] = p_coeffs[0];
+    }
+    else
+    {
+      p_coeffs[0] = 1.0f / a0;
+      p_coeffs[1] = -2.0f * cos_w0 / a0;
+      p_coeffs[2] = p_coeffs[0];
+    }
+    p_coeffs[3] = 2.0f * cos_w0 / a0;           //-a1/a0
+    p_coeffs[4] = -(1.0f - alpha) / a0;         //-a2/a0
 }
 
-// BLE CENTRAL CODE
-/**
- * @brief Parses advertisement data, providing length and location of the field in case
- *        matching data is found.
- *
- * @param[in]  type       Type of data to be looked for in advertisement data.
- * @param[in]  p_advdata  Advertisement report length and pointer to report.
- * @param[out] p_typedata If data type requested is found in the data report, type data length and
- *                        pointer to data will be populated here.
- *
- * @retval NRF_SUCCESS if the data type is found in the report.
- * @retval NRF_ERROR_NOT_FOUND if the data type could not be found.
- */
-static uint32_t adv_report_parse(uint8_t type, data_t * p_advdata, data_t * p_typedata)
+static void filter_block(int16_t * p_block, uint16_t len)
 {
-    uint32_t  index = 0;
-    uint8_t * p_data;
-
-    p_data = p_advdata->p_data;
+    if (filter_recompute)
+      filter_coefficients();
+    arm_q15_to_float(p_block, filter_work, len);
+    arm_biquad_cascade_df2T_f32(&m_filter, filter_work, filter_work, len);
+    arm_float_to_q15(filter_work, p_block, len);           //saturates
+}
 
-    while (index < p_advdata->data_len)
+//Rolled up as rms of the block rms's and max of the peaks
+static void meter_block(int16_t const * p_block, uint16_t len)
+{
+    static uint64_t rms_sq_sum = 0;
+    static uint16_t peak = 0, clips = 0;
+    static uint8_t blocks = 0;
+    q15_t rms;
+    uint16_t block_peak, n;
+
+    block_levels(p_block, len, &rms, &block_peak);
+    rms_sq_sum += (uint32_t)(rms * rms);
+    if (block_peak > peak)
+      peak = block_peak;
+    for(n=0;(n<len);n++)
     {
-        uint8_t field_length = p_data[index];
-        uint8_t field_type   = p_data[index + 1];
+      if (p_block[n] >= METER_CLIP_LEVEL || p_block[n] <= -METER_CLIP_LEVEL)
+        ++clips;
+    }
 
-        if (field_type == type)
-        {
-            p_typedata->p_data   = &p_data[index + 2];
-            p_typedata->data_len = field_length - 1;
-            return NRF_SUCCESS;
-        }
-        index += field_length + 1;
+    if (++blocks < METER_BLOCKS)
+      return;
+    meter_rms = (uint16_t)sqrtf((float32_t)(rms_sq_sum / METER_BLOCKS));
+    meter_peak = peak;
+    meter_clips = (clips > 255) ? 255 : clips;
+    meter_ready = 1;
+    rms_sq_sum = 0;
+    peak = clips = 0;
+    blocks = 0;
+}
+
+void vad_arm(uint8_t on)
+{
+    if (on)
+    {
+      vad_write = vad_hits = 0;
+      vad_blocks = 0;
+      vad_noise = 0;
+      vad_state = VAD_LISTEN;
+      mic_stream_users |= MIC_USER_VAD;
+      mic_stream_stop();                  //restart so the ring starts at block 0
+    }
+    else
+    {
+      if (vad_state == VAD_OFF)
+        return;
+      mic_stream_users &= ~MIC_USER_VAD;
+      mic_stream_stop();
+      vad_state = VAD_OFF;
     }
-    return NRF_ERROR_NOT_FOUND;
+    mic_stream_update();
 }
-/**@brief Function for handling database discovery events.
- *
- * @details This function is callback function to handle events from the database discovery module.
- *          Depending on the UUIDs that are discovered, this function should forward the events
- *          to their respective services.
- *
- * @param[in] p_event  Pointer to the database discovery event.
- */
-static void db_disc_handler(ble_db_discovery_evt_t * p_evt)
+
+//Integer only, this runs on every block while armed. Level is the mean abs value with dc taken out.
+//The noise floor follows the level slowly, and it doesn't trip until the ring has a full second in it.
+static void vad_block(int16_t const * p_block, uint16_t len)
 {
-  uint8_t i,j;
+    uint16_t n, zc;
+    int32_t sum, dc, x, level;
+    uint8_t loud, block, last_neg;
+
+    if (p_block < p_rx_buffer || p_block >= &p_rx_buffer[SAMPLE_BUFFER_CNT])
+      return;                                 //one of the small blocks from before the switch over
+    block = (p_block - p_rx_buffer) / PDM_BLOCK_LEN;
+    if (vad_state == VAD_POST)
+    {
+      if (--vad_post == 0)
+      {
+        vad_last_block = block;
+        vad_state = VAD_FROZEN;
+        mic_isr_stop = 1;
+        nrf_drv_pdm_stop();
+      }
+      return;
+    }
 
-  if (p_evt->evt_type == BLE_DB_DISCOVERY_COMPLETE)
-  {
-    j = p_evt->params.discovered_db.char_count;
-    for(i=0;(i<j);i++)
+    sum = 0;
+    for(n=0;(n<len);n++)
+      sum += p_block[n];
+    dc = sum / len;
+    sum = zc = 0;
+    last_neg = (p_block[0] < dc);
+    for(n=0;(n<len);n++)
     {
-        if(p_evt->params.discovered_db.charateristics[i].characteristic.uuid.uuid == LBS_UUID_CMD_CHAR)
-        {
-            remote_cmd_handle.value_handle = p_evt->params.discovered_db.charateristics[i].characteristic.handle_value;
-            remote_cmd_handle.cccd_handle =  p_evt->params.discovered_db.charateristics[i].cccd_handle;
-            TxUART("Got the handle\r\n");
-            return;
-        }
+      x = p_block[n] - dc;
+      if ((x < 0) != last_neg)
+      {
+        ++zc;
+        last_neg = (x < 0);
+      }
+      sum += (x < 0) ? -x : x;
+    }
+    level = sum / len;
+
+    if (vad_blocks < VAD_RING_BLOCKS)
+    {
+      ++vad_blocks;
+      if (vad_noise == 0)
+        vad_noise = level << 4;
+    }
+    loud = (level > VAD_MIN_LEVEL && (level << 4) > VAD_RATIO * vad_noise
+            && (zc < VAD_ZC_MAX || (level << 4) > 2 * VAD_RATIO * vad_noise));
+    if (loud == 0)
+    {
+      vad_hits = 0;
+      vad_noise += level - (vad_noise >> 4);
+      return;
+    }
+    if (++vad_hits >= VAD_HITS && vad_blocks >= VAD_RING_BLOCKS)
+    {
+      vad_post = VAD_POST_BLOCKS;
+      vad_state = VAD_POST;
     }
-  }
 }
 
-/**@brief Database discovery initialization.
- */
-static void db_discovery_init(void)
+//Main loop side. The ring's last full block is vad_last_block, the one after it was being filled when
+//it stopped so it's half new, half a second old. Rotate so the oldest full block is first, and zero the
+//half block, which ends up last.
+void vad_clip_ready(void)
 {
-    ret_code_t err_code = ble_db_discovery_init(db_disc_handler);
-    APP_ERROR_CHECK(err_code);
-    ble_db_discovery_evt_register(&ble_uuid_svc);
+    uint32_t first;
+
+    mic_stream_users &= ~MIC_USER_VAD;
+    mic_stream_stop();
+    first = (vad_last_block + 2) % VAD_RING_BLOCKS;
+    ring_rotate(p_rx_buffer, SAMPLE_BUFFER_CNT, first * PDM_BLOCK_LEN);
+    memset(&p_rx_buffer[SAMPLE_BUFFER_CNT - PDM_BLOCK_LEN], 0, PDM_BLOCK_LEN * sizeof(int16_t));
+    vad_state = VAD_OFF;
+    mic_stream_update();
+
+    p_sound = p_rx_buffer;
+    sound_len = SAMPLE_BUFFER_CNT;
+    clip_slices_valid(1);
+    clip_ready_pi();                              //same as RECORD_SOUND_PI from here
+    update_remote_event(EVENT_CLIP, 0, VAD_RING_BLOCKS - VAD_POST_BLOCKS);
+    TxUART("Sound clip ready\r\n");
 }
 
-/**@brief Function to start scanning.
- */
-static void scan_start(void)
+//In place rotate left by first, three reversals, no second buffer needed
+static void ring_rotate(int16_t * p_buf, uint32_t len, uint32_t first)
 {
-    ret_code_t err_code;
-
-    (void) sd_ble_gap_scan_stop();
+    uint32_t a, b;
+    int16_t t;
 
-    err_code = sd_ble_gap_scan_start(&m_scan_params);
-    APP_ERROR_CHECK(err_code);
+    for(a=0,b=first-1;(first!=0 && a<b);a++,b--)
+    {
+      t = p_buf[a]; p_buf[a] = p_buf[b]; p_buf[b] = t;
+    }
+    for(a=first,b=len-1;(a<b);a++,b--)
+    {
+      t = p_buf[a]; p_buf[a] = p_buf[b]; p_buf[b] = t;
+    }
+    for(a=0,b=len-1;(a<b);a++,b--)
+    {
+      t = p_buf[a]; p_buf[a] = p_buf[b]; p_buf[b] = t;
+    }
 }
 
-/**@brief Function for handling the advertising report BLE event.
- *
- * @param[in] p_ble_evt  Bluetooth stack event.
- */
-static void on_adv_report(const ble_evt_t * const p_ble_evt)
+//Goertzel coefficient for the exact freq, not rounded to a bin, so off bin tones don't lose power
+void tones_configure(void)
 {
-    ret_code_t err_code;
-    data_t     adv_data;
-    data_t     dev_name;
-    bool       do_connect = false;
-  
-    // For readibility.
-    ble_gap_evt_t  const * p_gap_evt  = &p_ble_evt->evt.gap_evt;
-    ble_gap_addr_t const * peer_addr  = &p_gap_evt->params.adv_report.peer_addr;
+    uint8_t i;
 
-    // Initialize advertisement report for parsing
-    adv_data.p_data   = (uint8_t *)p_gap_evt->params.adv_report.data;
-    adv_data.data_len = p_gap_evt->params.adv_report.dlen;
+    CRITICAL_REGION_ENTER();
+    for(i=0;(i<tone_cnt);i++)
+    {
+        tone_coeff[i] = 2.0f * arm_cos_f32(2.0f * PI * tones[i].freq / PDM_SAMPLE_RATE);
+        tone_hits[i] = 0;
+    }
+    CRITICAL_REGION_EXIT();
+}
 
-    // Search for advertising names.
-    bool name_found = false;
-    err_code = adv_report_parse(BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME, &adv_data, &dev_name);
+//A tone counts when it has TONE_RATIO of the block's power (dc taken out) for TONE_HITS blocks in a row.
+//It gets reported once, then has to go away for a block before it can be heard again.
+//For a pure tone right on freq, power = (A*N/2)^2 and block energy = A^2*N/2, so power/(energy*N/2) = 1.
+static void tones_block(int16_t const * p_block, uint16_t len)
+{
+    uint16_t n;
+    uint8_t t;
+    float32_t x, sum, energy, s0, s1, s2, power;
 
-    if (err_code != NRF_SUCCESS)
+    sum = energy = 0;
+    for(n=0;(n<len);n++)
     {
-        // Look for the short local name if it was not found as complete.
-        err_code = adv_report_parse(BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME, &adv_data, &dev_name);
-        if (err_code != NRF_SUCCESS)
+        x = p_block[n];
+        sum += x;
+        energy += x * x;
+    }
+    energy -= sum * sum / len;              //pdm has a dc offset, don't count it
+    for(t=0;(t<tone_cnt);t++)
+    {
+        if (tones[t].freq == 0 || energy < TONE_MIN_LEVEL * TONE_MIN_LEVEL * len)
         {
-            // If we can't parse the data, then exit
-           return;
+            tone_hits[t] = 0;
+            continue;
         }
-        else
+        s1 = s2 = 0;
+        for(n=0;(n<len);n++)
         {
-            name_found = true;
+            s0 = p_block[n] + tone_coeff[t] * s1 - s2;
+            s2 = s1;
+            s1 = s0;
         }
-    }
-    else
-    {
-        name_found = true;
-    }
-
-    if (name_found)
-    {
-        if (strlen(m_target_periph_name) != 0)
+        power = s1 * s1 + s2 * s2 - tone_coeff[t] * s1 * s2;
+        if (power > TONE_RATIO * energy * len / 2)
         {
-            if (memcmp(m_target_periph_name, dev_name.p_data, dev_name.data_len )== 0)
+            if (tone_hits[t] < TONE_HITS)
             {
-                found_skoobot = 1;
-                do_connect = true;
+                ++tone_hits[t];
+                if (tone_hits[t] == TONE_HITS)
+                  tones_heard |= 1 << t;
             }
         }
+        else
+        {
+            tone_hits[t] = 0;
+        }
     }
+}
 
-    if (do_connect)
-    {
-        (void) sd_ble_gap_scan_stop();
-        TxUART("Skoobot trying to connect as master\r\n");
-        // Initiate connection.
-        err_code = sd_ble_gap_connect(peer_addr,
-                                      &m_scan_params,
-                                      &m_connection_param,
-                                      APP_BLE_CONN_CFG_TAG);
-        APP_ERROR_CHECK(err_code);
+//Main loop side, events out, UART, and the slot's command if it has one
+void tones_report(void)
+{
+    uint8_t heard, t;
 
+    CRITICAL_REGION_ENTER();
+    heard = tones_heard;
+    tones_heard = 0;
+    CRITICAL_REGION_EXIT();
+    for(t=0;(t<tone_cnt);t++)
+    {
+        if ((heard & (1 << t)) == 0)
+          continue;
+        update_remote_event(EVENT_TONE, t, (uint16_t)tones[t].freq);
+        sprintf(buf_out,"Tone %u Hz\r\n",(uint16_t)tones[t].freq);
+        TxUART(buf_out);
+        if (tones[t].cmd != 0)
+          cmd_put(CMD_SRC_TONE, 0, tones[t].cmd, 0, 0, 0);
     }
 }
 
-//BLE_PERIPHERHAL CODE
-/**@brief Function for the GAP initialization.
- *
- * @details This function sets up all the necessary GAP (Generic Access Profile) parameters of the
- *          device including the device name, appearance, and the preferred connection parameters.
- */
-static void gap_params_init(void)
+#if MOTORS_STEPPING_PWM
+//in common mode and refresh mode, number of steps should be even
+//wheels with tires travel approximately 1.67mm per step, so 300 steps is 5cm
+//a 90 degree turn should be 10 steps
+void pwm_motor_stepping(uint32_t steps_per_second, uint32_t number_steps)
 {
-    ret_code_t              err_code;
-    ble_gap_conn_params_t   gap_conn_params;
-    ble_gap_conn_sec_mode_t sec_mode;
-
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
-
-    err_code = sd_ble_gap_device_name_set(&sec_mode,
-                                          (const uint8_t *)DEVICE_NAME,
-                                          strlen(DEVICE_NAME));
-    APP_ERROR_CHECK(err_code);
-
-    memset(&gap_conn_params, 0, sizeof(gap_conn_params));
+  volatile static uint16_t pwm_duty[2];
+  volatile static uint32_t pwm_top;
 
-    gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
-    gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
-    gap_conn_params.slave_latency     = SLAVE_LATENCY;
-    gap_conn_params.conn_sup_timeout  = CONN_SUP_TIMEOUT;
+  pwm_top = 125000 / steps_per_second; 
+  if( pwm_top > 0xffff)
+    pwm_top = 0xffff;
+  pwm_duty[0] = pwm_duty[1] = pwm_top / 2;
 
-    err_code = sd_ble_gap_ppcp_set(&gap_conn_params);
-    APP_ERROR_CHECK(err_code);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND1);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_shorts_set(NRF_PWM0, NRF_PWM_SHORT_LOOPSDONE_SEQSTART0_MASK);
+  nrf_pwm_configure(NRF_PWM0,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,pwm_top);
+  nrf_pwm_seq_ptr_set(NRF_PWM0,0,pwm_duty);
+  nrf_pwm_seq_cnt_set(NRF_PWM0,0,1);
+  nrf_pwm_seq_ptr_set(NRF_PWM0,1,pwm_duty);
+  nrf_pwm_seq_cnt_set(NRF_PWM0,1,1);
+  nrf_pwm_loop_set(NRF_PWM0,number_steps / 2);
+  nrf_pwm_task_trigger(NRF_PWM0, NRF_PWM_TASK_SEQSTART0);
+  step_loop_done = 0;
 }
 
-
-/**@brief Function for initializing the GATT module.
- */
-static void gatt_init(void)
+void PWM0_IRQHandler(void)
 {
-    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, NULL);
-    APP_ERROR_CHECK(err_code);
+    stop_stepping();
 }
 
-
-/**@brief Function for initializing the Advertising functionality.
- *
- * @details Encodes the required advertising data and passes it to the stack.
- *          Also builds a structure to be passed to the stack when starting advertising.
- */
-static void advertising_init(void)
+void stop_stepping(void)
 {
-    ret_code_t    err_code;
-    ble_advdata_t advdata;
-    ble_advdata_t srdata;
-
-    ble_uuid_t adv_uuids[] = {{LBS_UUID_SERVICE, uuid_type}};
+  if (nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE))
+  {
+    nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);  
+    if (nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_STOPPED) == 0)
+    {
+        nrf_pwm_task_trigger(NRF_PWM0, NRF_PWM_TASK_STOP);
+        while(nrf_pwm_event_check(NRF_PWM0, NRF_PWM_EVENT_STOPPED) == 0);
+        step_loop_done = 1;
+    }
+  }
+}
+#endif
 
-    // Build and set advertising data
-    memset(&advdata, 0, sizeof(advdata));
+void PWM1_IRQHandler(void)
+{
+    if (buzzer_mode == BUZZER_PCM)
+    {
+      pcm_seq_end();
+    }
+    else
+    {
+      stop_buzzer();
+      if (song_playing == 1 && buzzer_loops_done == 1)
+        song_next_note();
+    }
+}
 
-    advdata.name_type          = BLE_ADVDATA_FULL_NAME;
-    advdata.include_appearance = true;
-    advdata.flags              = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+//A plain tone takes the buzzer from any song that's playing
+void pwm_buzzer_frequency(float32_t freq, uint32_t loops)
+{
+  song_stop();
+  pcm_play_stop();
+  buzzer_tone(freq, loops, 0);
+}
 
+//125000/freq=    125000/250
+static void buzzer_tone(float32_t freq, uint32_t loops, uint8_t mute)
+{
+  float32_t main_freq;
+  volatile static uint16_t pwm_top, pwm_duty[2];
+   
+  if (loops < 2)
+    loops = 2;                          //a loop count of 0 never gives LOOPSDONE
+  main_freq = 125000.0 / freq;
 
-    memset(&srdata, 0, sizeof(srdata));
-    srdata.uuids_complete.uuid_cnt = sizeof(adv_uuids) / sizeof(adv_uuids[0]);
-    srdata.uuids_complete.p_uuids  = adv_uuids;
+  pwm_top = (uint16_t)main_freq;
+  pwm_duty[0] = pwm_duty[1] = (mute == 1) ? 0 : (uint16_t)(main_freq / 2.0);
 
-    err_code = ble_advdata_set(&advdata, &srdata);
-    APP_ERROR_CHECK(err_code);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_shorts_set(NRF_PWM1, NRF_PWM_SHORT_LOOPSDONE_SEQSTART0_MASK);
+  nrf_pwm_configure(NRF_PWM1,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,pwm_top);
+  nrf_pwm_seq_ptr_set(NRF_PWM1,0,pwm_duty);
+  nrf_pwm_seq_cnt_set(NRF_PWM1,0,1);
+  nrf_pwm_seq_ptr_set(NRF_PWM1,1,pwm_duty);
+  nrf_pwm_seq_cnt_set(NRF_PWM1,1,1);
+  nrf_pwm_loop_set(NRF_PWM1,loops / 2);
+  nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_SEQSTART0);
+  buzzer_loops_done = 0;
 }
 
-static uint32_t add_cmd_characteristic(void)
+void pcm_play_clip(int16_t const * p_pcm, uint32_t len)
+{
+  p_pcm16 = p_pcm;
+  pcm_len = len;
+  pcm_start();
+}
+
+static void pcm_start(void)
+{
+  song_playing = 0;
+  if (buzzer_loops_done == 0)
+  {
+    nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+    nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_STOP);      //tone, song or pcm still going
+    while(nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0);
+  }
+  buzzer_mode = BUZZER_PCM;
+  pcm_pos = 0;
+  pcm_tail = 0;
+  pcm_fill(pcm_seq[0]);
+  pcm_fill(pcm_seq[1]);
+
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_shorts_set(NRF_PWM1, 0);
+  nrf_pwm_configure(NRF_PWM1,PWM_PRESCALER_PRESCALER_DIV_1,PWM_MODE_UPDOWN_Up,PCM_TOP);
+  nrf_pwm_seq_ptr_set(NRF_PWM1,0,pcm_seq[0]);
+  nrf_pwm_seq_cnt_set(NRF_PWM1,0,PCM_SEQ_LEN);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,0,PCM_REFRESH);
+  nrf_pwm_seq_ptr_set(NRF_PWM1,1,pcm_seq[1]);
+  nrf_pwm_seq_cnt_set(NRF_PWM1,1,PCM_SEQ_LEN);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,1,PCM_REFRESH);
+  nrf_pwm_loop_set(NRF_PWM1,0xffff);                          //seq0, seq1, seq0... until pcm_seq_end stops it
+  nrf_pwm_int_set(NRF_PWM1, NRF_PWM_INT_SEQEND0_MASK | NRF_PWM_INT_SEQEND1_MASK);
+  buzzer_loops_done = 0;
+  nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_SEQSTART0);
+}
+
+//Past the end of the sound it fills with the mid point, silence
+static void pcm_fill(uint16_t * p_seq)
+{
+  uint16_t i;
+  uint32_t sample;
+
+  for(i=0;(i<PCM_SEQ_LEN);i++,pcm_pos++)
+  {
+    if (pcm_pos >= pcm_len)
+      sample = 128;
+    else
+      sample = (uint16_t)(p_pcm16[pcm_pos] + 32768) >> 8;
+    p_seq[i] = (uint16_t)((sample * PCM_TOP) >> 8);
+  }
+}
+
+//SEQENDn means buffer n is done and the other one is playing, so refill n. The first silent refill means the
+//last of the sound is playing now, the second means it's done.
+static void pcm_seq_end(void)
+{
+  uint8_t seq;
+
+  if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_SEQEND0))
+  {
+    nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
+    seq = 0;
+  }
+  else if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_SEQEND1))
+  {
+    nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
+    seq = 1;
+  }
+  else
+  {
+    return;
+  }
+  if (pcm_pos >= pcm_len)
+  {
+    if (++pcm_tail == 2)
+    {
+      pcm_play_stop();
+      return;
+    }
+  }
+  pcm_fill(pcm_seq[seq]);
+}
+
+//Puts PWM1 back the way pwm_buzzer_frequency expects it
+void pcm_play_stop(void)
+{
+  if (buzzer_mode != BUZZER_PCM)
+    return;
+  nrf_pwm_int_set(NRF_PWM1, NRF_PWM_INT_LOOPSDONE_MASK);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_STOP);
+  while(nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,0,0);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,1,0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
+  buzzer_mode = BUZZER_TONE;
+  buzzer_loops_done = 1;
+}
+
+//just toggles gpios for now
+void mb_test(void)
+{
+  static uint8_t range;
+
+  nrf_gpio_cfg_output(MIC_CLK);
+  nrf_gpio_cfg_output(MIC_DI);
+  nrf_gpio_cfg_output(SLEEP);
+  
+  for(;;)
+  {
+    led_on();
+    nrf_gpio_pin_clear(STEP);
+    nrf_gpio_pin_clear(DIR_L);
+    nrf_gpio_pin_clear(DIR_R);
+    nrf_gpio_pin_clear(M1);
+    nrf_gpio_pin_clear(M0);
+    nrf_gpio_pin_clear(MIC_CLK);
+    nrf_gpio_pin_clear(MIC_DI);
+    nrf_gpio_pin_clear(SLEEP);
+    nrf_delay_ms(500);
+    led_off();
+    nrf_gpio_pin_set(STEP);
+    nrf_gpio_pin_set(DIR_L);
+    nrf_gpio_pin_set(DIR_R);
+    nrf_gpio_pin_set(M1);
+    nrf_gpio_pin_set(M0);
+    nrf_gpio_pin_set(MIC_CLK);
+    nrf_gpio_pin_set(MIC_DI);
+    nrf_gpio_pin_set(SLEEP);
+    nrf_delay_ms(500);
+    range = getDistance();
+    sprintf(buf_out,"Range is %d\r\n",range);
+    TxUART(buf_out);
+
+    nrf_delay_ms(500);
+  }
+}
+
+void stop_buzzer(void)
+{
+  if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE))
+  {
+    nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);  
+    if (nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0)
+    {
+        nrf_pwm_task_trigger(NRF_PWM1, NRF_PWM_TASK_STOP);
+        while(nrf_pwm_event_check(NRF_PWM1, NRF_PWM_EVENT_STOPPED) == 0);
+        buzzer_loops_done = 1;
+    }
+  }
+}
+
+void uart_init(void)
+{
+  nrf_uarte_baudrate_set(NRF_UARTE0,NRF_UARTE_BAUDRATE_115200); 
+  nrf_uarte_txrx_pins_set(NRF_UARTE0,UART_TX_PIN,UART_RX_PIN);
+  nrf_uarte_configure(NRF_UARTE0,NRF_UARTE_PARITY_EXCLUDED,NRF_UARTE_HWFC_DISABLED);  //no parity, no hw flow control
+  nrf_uarte_rx_buffer_set(NRF_UARTE0,buf_in,UART_LEN_LIMIT);
+  nrf_uarte_tx_buffer_set(NRF_UARTE0,buf_out,UART_LEN_LIMIT);
+  nrf_uarte_enable(NRF_UARTE0);
+}
+
+void my_configure(void)
+{
+  nrf_gpio_cfg_output(DIR_L);
+  nrf_gpio_cfg_output(DIR_R);
+  nrf_gpio_cfg_output(SLEEP);
+  motors_sleep();               
+  motors_forward();
+  stepping_mode(HALF_STEP);         
+
+  nrf_gpio_pin_clear(STEP);
+  nrf_gpio_cfg_output(STEP);
+
+#if MOTORS_STEPPING_PWM
+  NRF_PWM0->PSEL.OUT[0] = STEP;
+
+  nrf_pwm_enable(NRF_PWM0);
+  nrf_pwm_configure(NRF_PWM0,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,1000);
+  nrf_pwm_loop_set(NRF_PWM0,0);
+  nrf_pwm_decoder_set(NRF_PWM0,PWM_DECODER_LOAD_Common,PWM_DECODER_MODE_RefreshCount);
+  nrf_pwm_seq_refresh_set(NRF_PWM0,0,0);
+  nrf_pwm_seq_end_delay_set(NRF_PWM0,0,0);
+  nrf_pwm_seq_refresh_set(NRF_PWM0,1,0);
+  nrf_pwm_seq_end_delay_set(NRF_PWM0,1,0);
+  nrf_pwm_shorts_set(NRF_PWM0, 0);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_LOOPSDONE);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_SEQEND1);
+  nrf_pwm_event_clear(NRF_PWM0, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_int_set(NRF_PWM0, NRF_PWM_INT_LOOPSDONE_MASK);
+  nrf_drv_common_irq_enable(PWM0_IRQn,APP_IRQ_PRIORITY_LOWEST);
+#else
+  //use gpio STEP and timer1
+  nrf_timer_event_clear(NRF_TIMER1,NRF_TIMER_EVENT_COMPARE0);
+  nrf_timer_mode_set(NRF_TIMER1,NRF_TIMER_MODE_TIMER);
+  nrf_timer_bit_width_set(NRF_TIMER1,NRF_TIMER_BIT_WIDTH_32);
+  nrf_timer_frequency_set(NRF_TIMER1,NRF_TIMER_FREQ_125kHz);
+  nrf_timer_cc_write(NRF_TIMER1,NRF_TIMER_CC_CHANNEL0,25);        // 200us per interrupt
+  nrf_timer_int_enable(NRF_TIMER1,NRF_TIMER_INT_COMPARE0_MASK);
+  nrf_drv_common_irq_enable(TIMER1_IRQn,APP_IRQ_PRIORITY_LOWEST);
+#endif
+
+  nrf_gpio_pin_clear(BUZZER_10MM);
+  nrf_gpio_cfg_output(BUZZER_10MM);
+  NRF_PWM1->PSEL.OUT[0] = BUZZER_10MM;
+
+  nrf_pwm_enable(NRF_PWM1);
+  nrf_pwm_configure(NRF_PWM1,PWM_PRESCALER_PRESCALER_DIV_128,PWM_MODE_UPDOWN_Up,1000);
+  nrf_pwm_loop_set(NRF_PWM1,0);
+  nrf_pwm_decoder_set(NRF_PWM1,PWM_DECODER_LOAD_Common,PWM_DECODER_MODE_RefreshCount);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,0,0);
+  nrf_pwm_seq_end_delay_set(NRF_PWM1,0,0);
+  nrf_pwm_seq_refresh_set(NRF_PWM1,1,0);
+  nrf_pwm_seq_end_delay_set(NRF_PWM1,1,0);
+  nrf_pwm_shorts_set(NRF_PWM1, 0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_LOOPSDONE);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND0);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_SEQEND1);
+  nrf_pwm_event_clear(NRF_PWM1, NRF_PWM_EVENT_STOPPED);
+  nrf_pwm_int_set(NRF_PWM1, NRF_PWM_INT_LOOPSDONE_MASK);
+  nrf_drv_common_irq_enable(PWM1_IRQn,APP_IRQ_PRIORITY_LOWEST);
+}
+
+//expects null terminated string, so use sprintf for buf
+void TxUART(uint8_t* sendbuffer)
+{
+    uint8_t j;
+
+    j=0;
+    while(sendbuffer[j] != 0)
+    {
+        ++j;
+        if (j > UART_LEN_LIMIT)
+        {
+          j = UART_LEN_LIMIT;
+          break;
+        }
+    }
+    if (stream_on == 1)
+      stream_send(STREAM_CH_LOG, sendbuffer, j);      //dropped if the host hasn't given the log credits
+    nrf_uarte_tx_buffer_set(NRF_UARTE0,sendbuffer,j);
+    nrf_uarte_event_clear(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX);
+    nrf_uarte_task_trigger(NRF_UARTE0,NRF_UARTE_TASK_STARTTX);
+    while( nrf_uarte_event_check(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX) == 0);   //This blocks on transmit, maybe fix for parallelism
+    nrf_uarte_event_clear(NRF_UARTE0,NRF_UARTE_EVENT_ENDTX);
+}
+
+void TxUART_DFT(void)
+{
+  uint8_t i;
+ 
+  for(i=0;(i<FFT_TEST_OUT_SAMPLES_LEN);i++)
+  {
+      sprintf(buf_out,"%d,",p_out_buffer[i]);
+      TxUART(buf_out);
+  }
+  TxUART("\r\n");
+}
+void configure_dft(void)
+{
+    arm_rfft_fast_init_f32(&m_rfft_f32, FFT_REAL_SAMPLES_LEN);
+    arm_rfft_init_q15(&m_rfft_q15, FFT_REAL_SAMPLES_LEN, m_ifft_flag, 1);
+}
+
+/**
+ * @brief Function for processing real sound samples.
+ * @param[in] p_input        Pointer to input data array with real samples in time domain. It gets trashed.
+ * @param[in] p_input_struct Pointer to rfft instance structure describing input data.
+ * @param[out] p_output      Pointer to processed data in frequency domain, packed complex pairs.
+ *                           p_output[0] is the DC bin and p_output[1] is the Nyquist bin, both real only.
+ */
+static void fft_process(float32_t *                  p_input,
+                        arm_rfft_fast_instance_f32 * p_input_struct,
+                        float32_t *                  p_output)
+{
+    // Use RFFT module to process the data.
+    arm_rfft_fast_f32(p_input_struct, p_input, p_output, m_ifft_flag);
+}
+
+/**
+ * @brief Float spectrum of int16 sound samples, normalized so the biggest bin is 0x7fff.
+ * @param[in]  p_samples  Sound samples, every stride'th one is used.
+ * @param[in]  stride     1 for every sample, 2 for every other one.
+ * @param[in]  p_rfft     Set up rfft instance, its length is the number of samples used.
+ * @param[in]  p_work     Scratch, fft length floats. Ends up with the magnitudes in it.
+ * @param[in]  p_spectrum Scratch, fft length floats for the packed fft output.
+ * @param[out] p_out      Normalized magnitudes, fft length / 2 bins, dc zapped.
+ */
+static void spectrum_f32(int16_t const * p_samples, uint32_t stride, arm_rfft_fast_instance_f32 * p_rfft,
+                         float32_t * p_work, float32_t * p_spectrum, uint16_t * p_out)
+{
+    uint32_t i, bins;
+    uint32_t  max_val_index;
+    float32_t max_value, normal_value, nyquist_value;
+
+    bins = p_rfft->fftLenRFFT / 2;
+    for(i=0;(i<p_rfft->fftLenRFFT);i++)
+    {
+          p_work[i] = p_samples[i*stride];
+    }
+
+    fft_process(p_work, p_rfft, p_spectrum);
+
+    //Nyquist bin is packed in with dc, pull it out, it only counts for the max
+    nyquist_value = fabsf(p_spectrum[1]);
+    p_spectrum[1] = 0;
+
+    // Calculate the magnitude at each bin, input buffer is free now so reuse it
+    arm_cmplx_mag_f32(p_spectrum, p_work, bins);
+
+    //zap dc component
+    p_work[0] = 0;
+
+    // Search FFT max value in output array.
+    arm_max_f32(p_work, bins, &max_value, &max_val_index);
+    if (nyquist_value > max_value)
+      max_value = nyquist_value;
+
+    normal_value = max_value / 0x7fff;
+
+    for(i=0;(i<bins);i++)
+    {
+          //normalize value and assign          
+          p_out[i] = (uint16_t)(p_work[i] / normal_value);         
+    }
+
+    fpu_clear_exceptions();
+}
+
+//Float code leaves exception flags in FPSCR, which keep the FPU interrupt pending and stop the cpu from sleeping
+static void fpu_clear_exceptions(void)
+{
+#ifndef FPU_INTERRUPT_MODE
+        /* Clear FPSCR register and clear pending FPU interrupts. This code is base on
+         * nRF5x_release_notes.txt in documentation folder. It is necessary part of code when
+         * application using power saving mode and after handling FPU errors in polling mode.
+         */
+        __set_FPSCR(__get_FPSCR() & ~(FPU_EXCEPTION_MASK));
+        (void) __get_FPSCR();
+        NVIC_ClearPendingIRQ(FPU_IRQn);
+#endif
+}
+
+/**
+ * @brief Q15 spectrum of int16 sound samples, same output as spectrum_f32 without touching the FPU.
+ *        arm_rfft_q15 scales down by the fft length as it goes, so quiet sounds lose bits, but the
+ *        normalizing at the end takes the scale back out.
+ * @param[in]  p_samples  Sound samples, every stride'th one is used. int16 is already q15.
+ * @param[in]  stride     1 for every sample, 2 for every other one.
+ * @param[in]  p_rfft     Set up rfft instance, its length is the number of samples used.
+ * @param[in]  p_work     Scratch, fft length q15s. Ends up with the magnitudes in it.
+ * @param[in]  p_spectrum Scratch, 2 * fft length q15s, arm_rfft_q15 writes the mirrored half too.
+ * @param[out] p_out      Normalized magnitudes, fft length / 2 bins, dc zapped.
+ */
+static void spectrum_q15(int16_t const * p_samples, uint32_t stride, arm_rfft_instance_q15 const * p_rfft,
+                         q15_t * p_work, q15_t * p_spectrum, uint16_t * p_out)
+{
+    uint32_t i, bins;
+    uint32_t max_val_index;
+    q15_t max_value, nyquist_value;
+
+    bins = p_rfft->fftLenReal / 2;
+    for(i=0;(i<p_rfft->fftLenReal);i++)
+    {
+          p_work[i] = p_samples[i*stride];
+    }
+
+    arm_rfft_q15(p_rfft, p_work, p_spectrum);
+
+    //Nyquist bin is the real part right after the unique half
+    nyquist_value = p_spectrum[2*bins];
+    if (nyquist_value < 0)
+      nyquist_value = -nyquist_value;
+
+    arm_cmplx_mag_q15(p_spectrum, p_work, bins);     //comes out 2.14, it all cancels out below
+
+    //zap dc component
+    p_work[0] = 0;
+
+    arm_max_q15(p_work, bins, &max_value, &max_val_index);
+    if ((nyquist_value >> 1) > max_value)            //2.14 to match the magnitudes
+      max_value = nyquist_value >> 1;
+    if (max_value == 0)                              //silence, don't divide by 0
+      max_value = 1;
+
+    for(i=0;(i<bins);i++)
+    {
+          p_out[i] = (uint16_t)(((uint32_t)p_work[i] * 0x7fff) / (uint32_t)max_value);
+    }
+}
+
+//coming into fft, input sample with be 1 second of mono, or 16,000 int16_t values. The fft takes only 64
+//inputs from this, every other sample. I will start in the middle, like at 800.
+//The input of the fft is 64 real sound values, no fake imaginary part needed with the real fft.
+//The output is 32 complex bins, which are the unique half of what the complex fft gave.
+//dft_mode picks float or q15, TOGGLE_DFT_Q15 switches it.
+void do_dft(void)
+{
+    if (dft_mode == DFT_MODE_Q15)
+    {
+        spectrum_q15(&p_rx_buffer[FFT_INPUT_START], 2, &m_rfft_q15,
+                     m_fft_input_q15, m_fft_output_q15, p_out_buffer);
+    }
+    else
+    {
+        spectrum_f32(&p_rx_buffer[FFT_INPUT_START], 2, &m_rfft_f32,
+                     m_fft_input_f32, m_fft_output_f32, p_out_buffer);
+    }
+}
+
+#if DFT_BENCHMARK
+//Big enough for the 1024 point run. This is 14k, too much to keep around in the robot build.
+#define BENCH_MAX_LEN    1024
+#define BENCH_RUNS       8
+static float32_t bench_work_f32[BENCH_MAX_LEN];
+static float32_t bench_spectrum_f32[BENCH_MAX_LEN];
+static q15_t     bench_work_q15[BENCH_MAX_LEN];
+static q15_t     bench_spectrum_q15[BENCH_MAX_LEN*2];
+static uint16_t  bench_out_f32[BENCH_MAX_LEN/2];
+static uint16_t  bench_out_q15[BENCH_MAX_LEN/2];
+
+//Runs before the softdevice is up so nothing interrupts the timing. Uses the DWT cycle counter.
+//Input is a made up signal, 1kHz at half scale plus a quiet 3kHz tone, written into the sound buffer.
+//Error is the q15 normalized spectrum against the f32 one, in 0-0x7fff units.
+void dft_benchmark(void)
+{
+    arm_rfft_fast_instance_f32 rfft_f32;
+    arm_rfft_instance_q15      rfft_q15;
+    uint32_t len, run, i, start, cycles_f32, cycles_q15, err, err_max, err_sum;
+
+    for(i=0;(i<BENCH_MAX_LEN);i++)
+    {
+        p_rx_buffer[i] = (int16_t)(16000.0f * arm_sin_f32(2.0f * PI * 1000.0f * i / 16125.0f)
+                                 +  500.0f * arm_sin_f32(2.0f * PI * 3000.0f * i / 16125.0f));
+    }
+
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT = 0;
+    DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+    TxUART("DFT benchmark, cycles are the average of 8 runs\r\n");
+    for(len=64;(len<=BENCH_MAX_LEN);len<<=1)
+    {
+        arm_rfft_fast_init_f32(&rfft_f32, len);
+        arm_rfft_init_q15(&rfft_q15, len, 0, 1);
+
+        start = DWT->CYCCNT;
+        for(run=0;(run<BENCH_RUNS);run++)
+          spectrum_f32(p_rx_buffer, 1, &rfft_f32, bench_work_f32, bench_spectrum_f32, bench_out_f32);
+        cycles_f32 = (DWT->CYCCNT - start) / BENCH_RUNS;
+
+        start = DWT->CYCCNT;
+        for(run=0;(run<BENCH_RUNS);run++)
+          spectrum_q15(p_rx_buffer, 1, &rfft_q15, bench_work_q15, bench_spectrum_q15, bench_out_q15);
+        cycles_q15 = (DWT->CYCCNT - start) / BENCH_RUNS;
+
+        err_max = err_sum = 0;
+        for(i=0;(i<len/2);i++)
+        {
+            if (bench_out_f32[i] > bench_out_q15[i])
+              err = bench_out_f32[i] - bench_out_q15[i];
+            else
+              err = bench_out_q15[i] - bench_out_f32[i];
+            err_sum += err;
+            if (err > err_max)
+              err_max = err;
+        }
+
+        //ram is the working buffers only, the twiddle tables are const in flash
+        sprintf(buf_out,"N %lu f32 %lu cyc %lu B\r\n",len,cycles_f32,len*2*sizeof(float32_t));
+        TxUART(buf_out);
+        sprintf(buf_out,"N %lu q15 %lu cyc %lu B\r\n",len,cycles_q15,len*3*sizeof(q15_t));
+        TxUART(buf_out);
+        sprintf(buf_out,"N %lu err max %lu avg %lu\r\n",len,err_max,err_sum/(len/2));
+        TxUART(buf_out);
+    }
+    for(;;);
+}
+#endif
+
+// BLE CENTRAL CODE
+//One pass over the AD structures of a report, a truncated structure ends it
+static void adv_report_fields(data_t const * p_advdata, struct adv_fields_struct * p_fields)
+{
+    static uint8_t const lbs_base[16] = LBS_UUID_BASE;
+    uint8_t const * p_data = p_advdata->p_data;
+    uint8_t const * p_field;
+    uint16_t index = 0;
+    uint8_t field_length, i;
+
+    memset(p_fields, 0, sizeof(*p_fields));
+    while (index + 1 < p_advdata->data_len)
+    {
+        field_length = p_data[index];
+        if (field_length == 0 || index + 1 + field_length > p_advdata->data_len)
+          break;
+        p_field = &p_data[index + 2];
+        switch (p_data[index + 1])
+        {
+          case BLE_GAP_AD_TYPE_COMPLETE_LOCAL_NAME:
+            p_fields->name.p_data   = (uint8_t *)p_field;
+            p_fields->name.data_len = field_length - 1;
+            break;
+          case BLE_GAP_AD_TYPE_SHORT_LOCAL_NAME:
+            if (p_fields->name.data_len == 0)
+            {
+              p_fields->name.p_data   = (uint8_t *)p_field;
+              p_fields->name.data_len = field_length - 1;
+            }
+            break;
+          case BLE_GAP_AD_TYPE_MANUFACTURER_SPECIFIC_DATA:
+            p_fields->manuf.p_data   = (uint8_t *)p_field;
+            p_fields->manuf.data_len = field_length - 1;
+            break;
+          case BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_COMPLETE:
+          case BLE_GAP_AD_TYPE_128BIT_SERVICE_UUID_MORE_AVAILABLE:
+            //over the air it's the base, little endian, with the 16 bit UUID in bytes 12 and 13
+            for(i=0;i+16<=field_length-1;i+=16)
+            {
+              if (memcmp(&p_field[i], lbs_base, 12) == 0 && uint16_decode(&p_field[i + 12]) == LBS_UUID_SERVICE &&
+                  p_field[i + 14] == lbs_base[14] && p_field[i + 15] == lbs_base[15])
+                p_fields->robot_uuid = 1;
+            }
+            break;
+          default:
+            break;
+        }
+        index += field_length + 1;
+    }
+}
+/**@brief Function for handling database discovery events.
+ *
+ * @details This function is callback function to handle events from the database discovery module.
+ *          Depending on the UUIDs that are discovered, this function should forward the events
+ *          to their respective services.
+ *
+ * @param[in] p_event  Pointer to the database discovery event.
+ */
+static void db_disc_handler(ble_db_discovery_evt_t * p_evt)
+{
+  uint8_t i,j;
+  int8_t slot;
+
+  slot = relay_find(p_evt->conn_handle);
+  if (p_evt->evt_type == BLE_DB_DISCOVERY_COMPLETE && slot >= 0)
+  {
+    j = p_evt->params.discovered_db.char_count;
+    for(i=0;(i<j);i++)
+    {
+        if(p_evt->params.discovered_db.charateristics[i].characteristic.uuid.uuid == LBS_UUID_CMD_CHAR)
+            relay_links[slot].cmd_handle = p_evt->params.discovered_db.charateristics[i].characteristic.handle_value;
+        if(p_evt->params.discovered_db.charateristics[i].characteristic.uuid.uuid == LBS_UUID_BYTE4_CHAR)
+            relay_links[slot].cmd4_handle = p_evt->params.discovered_db.charateristics[i].characteristic.handle_value;
+    }
+    sprintf(buf_out,"Relay %d got the handles\r\n",slot);
+    TxUART(buf_out);
+    relay_pump(slot);                   //anything forwarded while discovery ran
+  }
+}
+
+/**@brief Database discovery initialization.
+ */
+static void db_discovery_init(void)
+{
+    ret_code_t err_code = ble_db_discovery_init(db_disc_handler);
+    APP_ERROR_CHECK(err_code);
+    ble_db_discovery_evt_register(&ble_uuid_svc);
+    relay_init();
+}
+
+static void relay_init(void)
+{
+    uint8_t i;
+
+    for(i=0;i<RELAY_LINKS;i++)
+    {
+      relay_links[i].conn_handle = BLE_CONN_HANDLE_INVALID;
+      relay_links[i].cmd_handle = relay_links[i].cmd4_handle = 0;
+      relay_links[i].head = relay_links[i].tail = 0;
+    }
+    relay_cnt = 0;
+}
+
+//Slot of a relay link, -1 if it isn't one. BLE_CONN_HANDLE_INVALID finds a free slot.
+static int8_t relay_find(uint16_t conn_handle)
+{
+    int8_t i;
+
+    for(i=0;i<RELAY_LINKS;i++)
+    {
+      if (relay_links[i].conn_handle == conn_handle)
+        return i;
+    }
+    return -1;
+}
+
+static uint8_t relay_known_find(ble_gap_addr_t const * p_addr)
+{
+    uint8_t i;
+
+    for(i=0;i<relay_known_cnt;i++)
+    {
+      if (relay_known[i].addr_type == p_addr->addr_type &&
+          memcmp(relay_known[i].addr, p_addr->addr, BLE_GAP_ADDR_LEN) == 0)
+        return 1;
+    }
+    return 0;
+}
+
+//Central connects, the oldest goes when it's full
+static void relay_known_add(ble_gap_addr_t const * p_addr)
+{
+    if (relay_known_find(p_addr) == 1)
+      return;
+    relay_known[relay_known_next] = *p_addr;
+    relay_known_next = (relay_known_next + 1) % RELAY_KNOWN;
+    if (relay_known_cnt < RELAY_KNOWN)
+      ++relay_known_cnt;
+}
+
+//Main loop, queues the command on every selected link. Commands with args go to the 4 byte characteristic
+//when the robot has one, otherwise just the command byte.
+static void relay_forward(uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code)
+{
+    struct relay_cmd_struct * p_cmd;
+    uint8_t i;
+
+    for(i=0;i<RELAY_LINKS;i++)
+    {
+      if (relay_links[i].conn_handle == BLE_CONN_HANDLE_INVALID || !(relay_mask & (1 << i)))
+        continue;
+      CRITICAL_REGION_ENTER();                  //WRITE_CMD_TX_COMPLETE pumps too
+      if ((uint8_t)(relay_links[i].head - relay_links[i].tail) >= RELAY_QUEUE_LEN)
+      {
+        ++relay_dropped;
+      }
+      else
+      {
+        p_cmd = &relay_links[i].queue[relay_links[i].head & (RELAY_QUEUE_LEN-1)];
+        p_cmd->data[0] = cmd;
+        p_cmd->len = 1;
+        if (args == 1 && relay_links[i].cmd4_handle != 0)
+        {
+          p_cmd->data[1] = (uint8_t)(speed>>8);
+          p_cmd->data[2] = (uint8_t)speed;
+          p_cmd->data[3] = code;
+          p_cmd->len = 4;
+        }
+        ++relay_links[i].head;
+      }
+      relay_pump(i);
+      CRITICAL_REGION_EXIT();
+    }
+}
+
+//Writes queued commands until the softdevice's write command queue for the link is full, from relay_forward,
+//discovery finishing and BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE. The softdevice copies write command data.
+static void relay_pump(uint8_t slot)
+{
+    struct relay_link_struct * p_link = &relay_links[slot];
+    struct relay_cmd_struct * p_cmd;
+    ble_gattc_write_params_t params;
+    uint32_t err_code;
+
+    CRITICAL_REGION_ENTER();
+    while(p_link->head != p_link->tail && p_link->cmd_handle != 0)
+    {
+      p_cmd = &p_link->queue[p_link->tail & (RELAY_QUEUE_LEN-1)];
+      memset(&params, 0, sizeof(params));
+      params.write_op = BLE_GATT_OP_WRITE_CMD;
+      params.flags = BLE_GATT_EXEC_WRITE_FLAG_PREPARED_WRITE;
+      params.handle = (p_cmd->len == 4) ? p_link->cmd4_handle : p_link->cmd_handle;
+      params.offset = 0;
+      params.p_value = p_cmd->data;
+      params.len = p_cmd->len;
+      err_code = sd_ble_gattc_write(p_link->conn_handle, &params);
+      if (err_code == NRF_ERROR_RESOURCES)
+        break;                                //wait for WRITE_CMD_TX_COMPLETE
+      if (err_code != NRF_SUCCESS)
+        ++relay_dropped;
+      ++p_link->tail;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+static void relay_connect_disconnect(void)
+{
+    uint8_t i;
+
+    if (relay_scanning == 1)
+    {
+      relay_scanning = 0;
+      if (relay_connecting == 1 && sd_ble_gap_connect_cancel() == NRF_SUCCESS)
+        relay_connecting = 0;                 //no event comes for a cancelled connect
+      scan_start();                           //back to following if it was
+      sprintf(buf_out,"Relay scan stopped, %d robots\r\n",relay_cnt);
+      TxUART(buf_out);
+    }
+    else if (relay_cnt == 0)
+    {
+      relay_scanning = 1;
+      scan_start();
+    }
+    else
+    {
+      for(i=0;i<RELAY_LINKS;i++)
+      {
+        if (relay_links[i].conn_handle != BLE_CONN_HANDLE_INVALID)
+          (void) sd_ble_gap_disconnect(relay_links[i].conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+      }
+    }
+}
+
+//Commands about this robot's own links, never passed on to a relay link or the swarm
+static uint8_t cmd_stays_here(uint8_t cmd)
+{
+    return (cmd == CONNECT_DISCONNECT || cmd == RELAY_SELECT || cmd == SWARM_LEAD || cmd == SWARM_FOLLOW ||
+            cmd == BEACON_RATE || cmd == BOND_MODE) ? 1 : 0;
+}
+
+//Off puts the normal advertising data back for the next advertising_start
+static void swarm_lead_set(uint8_t on)
+{
+    if (swarm_lead == 1)
+    {
+      (void) sd_ble_gap_adv_stop();
+      advertising_init();
+    }
+    swarm_lead = on;
+    if (on == 1)
+      TxUART("Swarm leader\r\n");
+}
+
+static void swarm_follow_set(uint8_t on)
+{
+    swarm_follow = on;
+    swarm_seen_any = 0;
+    scan_start();
+    TxUART(on ? "Following a swarm leader\r\n" : "Not following\r\n");
+}
+
+//Main loop, replaces whatever the leader was advertising, the advertiser is restarted so it goes out at once
+static void swarm_broadcast(uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code)
+{
+    ret_code_t                 err_code;
+    ble_advdata_t              advdata;
+    ble_advdata_manuf_data_t   manuf;
+    ble_gap_adv_params_t       adv_params;
+
+    ++swarm_seq;
+    swarm_data[0] = SWARM_MAGIC;
+    swarm_data[1] = swarm_seq;
+    swarm_data[2] = cmd | ((args == 1) ? FRAME_ARGS : 0);
+    swarm_data[3] = (uint8_t)(speed>>8);
+    swarm_data[4] = (uint8_t)speed;
+    swarm_data[5] = code;
+
+    memset(&manuf, 0, sizeof(manuf));
+    manuf.company_identifier = SWARM_COMPANY_ID;
+    manuf.data.p_data = swarm_data;
+    manuf.data.size = SWARM_DATA_LEN;
+
+    memset(&advdata, 0, sizeof(advdata));
+    advdata.name_type             = BLE_ADVDATA_NO_NAME;
+    advdata.flags                 = BLE_GAP_ADV_FLAG_BR_EDR_NOT_SUPPORTED;
+    advdata.p_manuf_specific_data = &manuf;
+
+    (void) sd_ble_gap_adv_stop();
+    err_code = ble_advdata_set(&advdata, NULL);
+    APP_ERROR_CHECK(err_code);
+
+    memset(&adv_params, 0, sizeof(adv_params));
+    adv_params.type        = BLE_GAP_ADV_TYPE_ADV_NONCONN_IND;
+    adv_params.p_peer_addr = NULL;
+    adv_params.fp          = BLE_GAP_ADV_FP_ANY;
+    adv_params.interval    = SWARM_ADV_INTERVAL;
+    adv_params.timeout     = 0;
+
+    err_code = sd_ble_gap_adv_start(&adv_params, APP_BLE_CONN_CFG_TAG);
+    if (err_code != NRF_SUCCESS)
+    {
+      sprintf(buf_out,"Swarm broadcast failed %lu\r\n",err_code);
+      TxUART(buf_out);
+    }
+}
+
+//From on_adv_report, the softdevice event interrupt. The leader repeats a command every interval until it has
+//a new one, only a change of seq is a new command.
+static void swarm_adv_report(data_t const * p_manuf)
+{
+    uint8_t  const * p;
+
+    p = p_manuf->p_data;
+    if (p_manuf->data_len < 2 + SWARM_DATA_LEN || uint16_decode(p) != SWARM_COMPANY_ID || p[2] != SWARM_MAGIC)
+      return;
+    if (swarm_seen_any == 1 && p[3] == swarm_seq_seen)
+      return;
+    swarm_seen_any = 1;
+    swarm_seq_seen = p[3];
+    ++swarm_heard;
+    cmd_put(CMD_SRC_SWARM, p[3], p[4] & ~FRAME_ARGS, (p[4] & FRAME_ARGS) ? 1 : 0,
+            (((uint16_t)p[5])<<8) | p[6], p[7]);
+}
+
+//period 0 stops it and takes the beacon out of the advertising data, anything under BEACON_MIN_MS is raised to it
+static void beacon_rate(uint16_t period)
+{
+    app_timer_stop(m_beacon_timer);
+    beacon_due = 0;
+    beacon_period = 0;
+    if (period != 0)
+    {
+      if (period < BEACON_MIN_MS)
+        period = BEACON_MIN_MS;
+      if (app_timer_start(m_beacon_timer, APP_TIMER_TICKS(period), NULL) == NRF_SUCCESS)
+      {
+        beacon_period = period;
+        beacon_due = 1;                         //first one now
+        sensor_start();
+        return;
+      }
+    }
+    if (swarm_lead == 0)
+    {
+      if (BLE_P_Connected == 1)
+        (void) sd_ble_gap_adv_stop();
+      advertising_init();
+    }
+}
+
+//Main loop and the not connected loop, readings come from the sensor cache, nothing here waits on TWI
+static void beacon_update(void)
+{
+    ble_gap_adv_params_t adv_params;
+    uint8_t flags = 0;
+
+    beacon_due = 0;
+    if (swarm_lead == 1 || beacon_period == 0)
+      return;
+    if (BLE_P_Connected == 1)
+      flags |= BEACON_CONNECTED;
+    if (swarm_follow == 1)
+      flags |= BEACON_FOLLOWING;
+    if (relay_cnt != 0)
+      flags |= BEACON_RELAYING;
+    if (mic_stream_users != 0 || flash_state != FLASH_REC_IDLE)
+      flags |= BEACON_MIC;
+    beacon_data[0] = BEACON_MAGIC;
+    ++beacon_data[1];
+    beacon_data[2] = sensor_range;
+    beacon_data[3] = (uint8_t)(sensor_lux>>8);
+    beacon_data[4] = (uint8_t)sensor_lux;
+    beacon_data[5] = (uint8_t)(sensor_vdd>>8);
+    beacon_data[6] = (uint8_t)sensor_vdd;
+    beacon_data[7] = motor_state;
+    beacon_data[8] = flags;
+    advertising_init();                         //data changes under the running advertiser
+    if (BLE_P_Connected == 1)
+    {
+      memset(&adv_params, 0, sizeof(adv_params));
+      adv_params.type        = BLE_GAP_ADV_TYPE_ADV_NONCONN_IND;
+      adv_params.p_peer_addr = NULL;
+      adv_params.fp          = BLE_GAP_ADV_FP_ANY;
+      adv_params.interval    = APP_ADV_INTERVAL;
+      adv_params.timeout     = 0;
+      (void) sd_ble_gap_adv_start(&adv_params, APP_BLE_CONN_CFG_TAG);   //invalid state when it's already going
+    }
+}
+
+static void beacon_timeout_handler(void * p_context)
+{
+    beacon_due = 1;
+}
+
+//VDD in mV, one blocking SAADC sample, 1/6 gain on the 0.6V reference is 3.6V full scale at 10 bits
+static uint16_t vdd_read(void)
+{
+    static nrf_saadc_value_t sample;
+
+    nrf_saadc_resolution_set(NRF_SAADC_RESOLUTION_10BIT);
+    NRF_SAADC->CH[0].CONFIG = (SAADC_CH_CONFIG_GAIN_Gain1_6 << SAADC_CH_CONFIG_GAIN_Pos) |
+                              (SAADC_CH_CONFIG_REFSEL_Internal << SAADC_CH_CONFIG_REFSEL_Pos) |
+                              (SAADC_CH_CONFIG_TACQ_10us << SAADC_CH_CONFIG_TACQ_Pos);
+    nrf_saadc_channel_input_set(0, NRF_SAADC_INPUT_VDD, NRF_SAADC_INPUT_DISABLED);
+    nrf_saadc_buffer_init(&sample, 1);
+    nrf_saadc_enable();
+    nrf_saadc_event_clear(NRF_SAADC_EVENT_STARTED);
+    nrf_saadc_event_clear(NRF_SAADC_EVENT_END);
+    nrf_saadc_task_trigger(NRF_SAADC_TASK_START);
+    while (!nrf_saadc_event_check(NRF_SAADC_EVENT_STARTED));
+    nrf_saadc_task_trigger(NRF_SAADC_TASK_SAMPLE);
+    while (!nrf_saadc_event_check(NRF_SAADC_EVENT_END));
+    nrf_saadc_event_clear(NRF_SAADC_EVENT_STOPPED);
+    nrf_saadc_task_trigger(NRF_SAADC_TASK_STOP);
+    while (!nrf_saadc_event_check(NRF_SAADC_EVENT_STOPPED));
+    nrf_saadc_disable();
+    nrf_saadc_channel_input_set(0, NRF_SAADC_INPUT_DISABLED, NRF_SAADC_INPUT_DISABLED);
+    if (sample < 0)
+      sample = 0;
+    return (uint16_t)(((uint32_t)sample * 3600) / 1024);
+}
+
+/**@brief Function to start scanning.
+ */
+static void scan_start(void)
+{
+    ret_code_t err_code;
+    ble_gap_scan_params_t scan_params;
+
+    (void) sd_ble_gap_scan_stop();
+    if (relay_scanning == 0 && swarm_follow == 0)
+      return;
+    if (relay_connecting == 1)                //the scanner is the initiator's, CONNECTED or the timeout rescans
+      return;
+
+    //a follower needs the whole interval to catch the leader and that finds robots as well, it only scans
+    //actively while it's relaying too, the leader's non-connectable advertising doesn't answer anyway
+    scan_params = swarm_follow ? m_swarm_scan_params : m_scan_params;
+    scan_params.active = relay_scanning;
+    err_code = sd_ble_gap_scan_start(&scan_params);
+    APP_ERROR_CHECK(err_code);
+}
+
+/**@brief Function for handling the advertising report BLE event.
+ *
+ * @param[in] p_ble_evt  Bluetooth stack event.
+ */
+static void on_adv_report(const ble_evt_t * const p_ble_evt)
+{
+    ret_code_t err_code;
+    data_t     adv_data;
+    struct adv_fields_struct fields;
+    bool       do_connect = false;
+    bool       connectable;
+  
+    // For readibility.
+    ble_gap_evt_t  const * p_gap_evt  = &p_ble_evt->evt.gap_evt;
+    ble_gap_addr_t const * peer_addr  = &p_gap_evt->params.adv_report.peer_addr;
+
+    // Robots only answer scan requests on connectable advertising, the type isn't set on a scan response
+    // An active scan reports a robot twice, its ADV_IND and then its SCAN_RSP, and the second can already be
+    // queued when the scan is stopped for the first, so only one connect goes out at a time
+    connectable = (relay_scanning == 1 && relay_connecting == 0 && relay_cnt < RELAY_LINKS &&
+                   (p_gap_evt->params.adv_report.scan_rsp == 1 ||
+                    p_gap_evt->params.adv_report.type == BLE_GAP_ADV_TYPE_ADV_IND));
+    if (connectable && relay_known_find(peer_addr) == 1)
+    {
+        do_connect = true;
+    }
+    else
+    {
+        if (connectable == false && swarm_follow == 0)
+            return;
+
+        // Initialize advertisement report for parsing
+        adv_data.p_data   = (uint8_t *)p_gap_evt->params.adv_report.data;
+        adv_data.data_len = p_gap_evt->params.adv_report.dlen;
+        adv_report_fields(&adv_data, &fields);
+
+        if (swarm_follow == 1 && fields.manuf.data_len != 0)
+            swarm_adv_report(&fields.manuf);
+        if (connectable && (fields.robot_uuid == 1 ||
+            (fields.name.data_len == strlen(m_target_periph_name) &&
+             memcmp(m_target_periph_name, fields.name.p_data, fields.name.data_len) == 0)))
+            do_connect = true;
+    }
+    if (do_connect)
+    {
+        found_skoobot = 1;
+        (void) sd_ble_gap_scan_stop();
+        TxUART("Skoobot trying to connect as master\r\n");
+        // Initiate connection.
+        relay_connecting = 1;
+        err_code = sd_ble_gap_connect(peer_addr,
+                                      &m_scan_params,
+                                      &m_connection_param,
+                                      RELAY_CONN_CFG_TAG);
+        if (err_code != NRF_SUCCESS)
+        {
+            relay_connecting = 0;
+            sprintf(buf_out,"Relay connect failed %lu\r\n",err_code);
+            TxUART(buf_out);
+            scan_start();
+        }
+
+    }
+}
+
+//BLE_PERIPHERHAL CODE
+/**@brief Function for the GAP initialization.
+ *
+ * @details This function sets up all the necessary GAP (Generic Access Profile) parameters of the
+ *          device including the device name, appearance, and the preferred connection parameters.
+ */
+static void gap_params_init(void)
+{
+    ret_code_t              err_code;
+    ble_gap_conn_params_t   gap_conn_params;
+    ble_gap_conn_sec_mode_t sec_mode;
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&sec_mode);
+
+    err_code = sd_ble_gap_device_name_set(&sec_mode,
+                                          (const uint8_t *)DEVICE_NAME,
+                                          strlen(DEVICE_NAME));
+    APP_ERROR_CHECK(err_code);
+
+    memset(&gap_conn_params, 0, sizeof(gap_conn_params));
+
+    gap_conn_params.min_conn_interval = MIN_CONN_INTERVAL;
+    gap_conn_params.max_conn_interval = MAX_CONN_INTERVAL;
+    gap_conn_params.slave_latency     = SLAVE_LATENCY;
+    gap_conn_params.conn_sup_timeout  = CONN_SUP_TIMEOUT;
+
+    err_code = sd_ble_gap_ppcp_set(&gap_conn_params);
+    APP_ERROR_CHECK(err_code);
+}
+
+
+/**@brief Function for initializing the GATT module.
+ */
+static void gatt_init(void)
+{
+    ret_code_t err_code = nrf_ble_gatt_init(&m_gatt, gatt_evt_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = nrf_ble_gatt_att_mtu_central_set(&m_gatt, BLE_GATT_ATT_MTU_DEFAULT);   //all RELAY_CONN_CFG_TAG has
+    APP_ERROR_CHECK(err_code);
+}
+
+//Packet size follows the MTU the peripheral link ends up with
+static void gatt_evt_handler(nrf_ble_gatt_t * p_gatt, nrf_ble_gatt_evt_t const * p_evt)
+{
+    if (p_evt->conn_handle != m_conn_p_handle)
+      return;
+    switch (p_evt->evt_id)
+    {
+      case NRF_BLE_GATT_EVT_ATT_MTU_UPDATED:
+        mtu_settled = 1;
+        multi_len = (p_evt->params.att_mtu_effective - 3) & ~1;
+        sprintf(buf_out,"MTU %d, %d byte packets\r\n",p_evt->params.att_mtu_effective,multi_len);
+        TxUART(buf_out);
+        break;
+      case NRF_BLE_GATT_EVT_DATA_LENGTH_UPDATED:
+        sprintf(buf_out,"Data length %d\r\n",p_evt->params.data_length);
+        TxUART(buf_out);
+        break;
+      default:
+        break;
+    }
+}
+
+//Picks the MTU and data length nrf_ble_gatt asks a new peripheral link for, and notes peers that drop out
+//before the MTU exchange finishes
+static void mtu_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
+{
+    ble_gap_evt_t const * p_gap_evt = &p_ble_evt->evt.gap_evt;
+    uint8_t i, fallback = 0;
+
+    switch (p_ble_evt->header.evt_id)
+    {
+      case BLE_GAP_EVT_CONNECTED:
+        if (p_gap_evt->params.connected.role != BLE_GAP_ROLE_PERIPH)
+        {
+          nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, BLE_GATT_ATT_MTU_DEFAULT + 4);
+          break;                            //relay links stay small
+        }
+        mtu_peer = p_gap_evt->params.connected.peer_addr;
+        multi_len = MULTI_LEN;
+        for(i=0;(i<mtu_fallback_cnt);i++)
+        {
+          if (memcmp(mtu_fallback_peers[i].addr, mtu_peer.addr, BLE_GAP_ADDR_LEN) == 0)
+            fallback = 1;
+        }
+        if (fallback == 1)
+        {
+          nrf_ble_gatt_att_mtu_periph_set(&m_gatt, BLE_GATT_ATT_MTU_DEFAULT);
+          nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, BLE_GATT_ATT_MTU_DEFAULT + 4);
+          TxUART("Known small MTU peer, staying at 23\r\n");
+        }
+        else
+        {
+          nrf_ble_gatt_att_mtu_periph_set(&m_gatt, NRF_SDH_BLE_GATT_MAX_MTU_SIZE);
+          nrf_ble_gatt_data_length_set(&m_gatt, BLE_CONN_HANDLE_INVALID, NRF_SDH_BLE_GATT_MAX_MTU_SIZE + 4);
+        }
+        mtu_settled = fallback;               //nothing to wait for when it's staying at 23
+        break;
+      case BLE_GAP_EVT_DISCONNECTED:
+        if (p_gap_evt->conn_handle != m_conn_p_handle)
+          break;
+        if (mtu_settled == 0)
+        {
+          mtu_fallback_peers[mtu_fallback_next] = mtu_peer;
+          mtu_fallback_next = (mtu_fallback_next + 1) % MTU_FALLBACK_PEERS;
+          if (mtu_fallback_cnt < MTU_FALLBACK_PEERS)
+            ++mtu_fallback_cnt;
+          TxUART("Lost the link during the MTU exchange, peer falls back to 23\r\n");
+        }
+        multi_len = MULTI_LEN;
+        break;
+      default:
+        break;
+    }
+}
+
+
+/**@brief Function for initializing the Advertising functionality.
+ *
+ * @details Encodes the required advertising data and passes it to the stack.
+ *          Also builds a structure to be passed to the stack when starting advertising.
+ */
+static void advertising_init(void)
+{
+    ret_code_t    err_code;
+    ble_advdata_t advdata;
+    ble_advdata_t srdata;
+    ble_advdata_manuf_data_t manuf;
+    ble_advertising_init_t   init;
+
+    static ble_uuid_t adv_uuids[] = {{LBS_UUID_SERVICE, 0}};   // the module keeps a pointer to it
+
+    adv_uuids[0].type = uuid_type;
+
+    // Build and set advertising data, the service UUID goes in it, or in the scan response with the beacon
+    memset(&advdata, 0, sizeof(advdata));
+    memset(&srdata, 0, sizeof(srdata));
+
+    advdata.include_appearance = true;
+    advdata.flags              = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+    if (m_advertising.initialized == true)
+      advdata.flags = m_advertising.advdata.flags;   // not discoverable while the module has the whitelist on
+    srdata.name_type           = BLE_ADVDATA_FULL_NAME;
+    if (beacon_period != 0)
+    {
+        // 3 flags, 4 appearance, 13 beacon, the 18 of the UUID don't fit then and go with the name, a relay
+        // only finds it scanning actively, a passive scanner sees the beacon and no UUID
+        memset(&manuf, 0, sizeof(manuf));
+        manuf.company_identifier = SWARM_COMPANY_ID;
+        manuf.data.p_data = beacon_data;
+        manuf.data.size = BEACON_DATA_LEN;
+        advdata.p_manuf_specific_data = &manuf;
+        srdata.uuids_complete.uuid_cnt = sizeof(adv_uuids) / sizeof(adv_uuids[0]);
+        srdata.uuids_complete.p_uuids  = adv_uuids;
+    }
+    else
+    {
+        // 3 flags, 4 appearance, 18 UUID
+        advdata.uuids_complete.uuid_cnt = sizeof(adv_uuids) / sizeof(adv_uuids[0]);
+        advdata.uuids_complete.p_uuids  = adv_uuids;
+    }
+
+    if (m_advertising.initialized == false)
+    {
+        memset(&init, 0, sizeof(init));
+        init.advdata = advdata;
+        init.srdata  = srdata;
+
+        init.config.ble_adv_on_disconnect_disabled = true;   // the disconnect handler frees the advertiser first
+        init.config.ble_adv_whitelist_enabled      = true;
+        init.config.ble_adv_directed_enabled       = true;
+        init.config.ble_adv_fast_enabled           = true;
+        init.config.ble_adv_fast_interval          = APP_ADV_FAST_INTERVAL;
+        init.config.ble_adv_fast_timeout           = APP_ADV_FAST_TIMEOUT;
+        init.config.ble_adv_slow_enabled           = true;
+        init.config.ble_adv_slow_interval          = APP_ADV_SLOW_INTERVAL;
+        init.config.ble_adv_slow_timeout           = APP_ADV_SLOW_TIMEOUT;
+
+        init.evt_handler   = on_adv_evt;
+        init.error_handler = adv_error_handler;
+
+        err_code = ble_advertising_init(&m_advertising, &init);
+        APP_ERROR_CHECK(err_code);
+
+        ble_advertising_conn_cfg_tag_set(&m_advertising, APP_BLE_CONN_CFG_TAG);
+        return;
+    }
+    // Beacon and swarm data changes go straight to the stack, the running mode carries on
+    err_code = ble_advdata_set(&advdata, &srdata);
+    APP_ERROR_CHECK(err_code);
+}
+
+static uint32_t add_cmd_characteristic(void)
 {
     ble_gatts_char_md_t char_md;          //server characteristic metadata
     ble_gatts_attr_t    attr_char_value;
@@ -1852,7 +4283,263 @@ static uint32_t add_cmd_characteristic(void)
     memset(&attr_md, 0, sizeof(attr_md));
 
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = sizeof(uint8_t);
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = sizeof(uint8_t);
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &cmd_handle);
+
+}
+
+static uint32_t add_cmd4_characteristic(void)
+{
+    ble_gatts_char_md_t char_md;          //server characteristic metadata
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+    uint8_t i;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read  = 1;
+    char_md.char_props.write = 1;
+    char_md.p_char_user_desc = NULL;
+    char_md.p_char_pf        = NULL;
+    char_md.p_user_desc_md   = NULL;
+    char_md.p_cccd_md        = NULL;
+    char_md.p_sccd_md        = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_BYTE4_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 4;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = 4;
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &data_4byte_handle);
+
+}
+
+//Have 3 characteristics to do, just doing 20 byte for sound pcm file transfer
+static uint32_t add_mult_data_characteristics(void)
+{
+    ret_code_t     err_code;
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+       
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.char_props.write  = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_BYTE128_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 1;                      //Have to set this to get an authorize event
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;                      //packets grow with the MTU
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = MULTI_LEN;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = MULTI_LEN_MAX;
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &data_128byte_handle);   
+}
+
+static uint32_t add_data_characteristic(void)
+{
+    ret_code_t     err_code;
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+       
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_DATA_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = sizeof(uint8_t);
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = sizeof(uint8_t);
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &data_handle);   
+}
+
+static uint32_t add_data2_characteristic(void)
+{
+    ret_code_t     err_code;
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+       
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_BYTE2_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 0;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 2;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = 2;
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &data_2byte_handle);   
+}
+//Things that happen on their own, like a tone being heard, show up here as notifies
+static uint32_t add_event_characteristic(void)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+       
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_EVENT_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
     attr_md.vloc    = BLE_GATTS_VLOC_STACK;
     attr_md.rd_auth = 0;
     attr_md.wr_auth = 0;
@@ -1862,43 +4549,47 @@ static uint32_t add_cmd_characteristic(void)
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = sizeof(uint8_t);
+    attr_char_value.init_len  = 4;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = sizeof(uint8_t);
+    attr_char_value.max_len   = 4;
     attr_char_value.p_value   = NULL;
 
     return sd_ble_gatts_characteristic_add(svc_handle,
                                            &char_md,
                                            &attr_char_value,
-                                           &cmd_handle);
-
+                                           &event_handle);   
 }
-
-static uint32_t add_cmd4_characteristic(void)
+static uint32_t add_level_characteristic(void)
 {
-    ble_gatts_char_md_t char_md;          //server characteristic metadata
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
     ble_gatts_attr_t    attr_char_value;
     ble_uuid_t          ble_uuid;
     ble_gatts_attr_md_t attr_md;
-    uint8_t i;
+       
+    memset(&cccd_md, 0, sizeof(cccd_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.write_perm);
+    cccd_md.vloc = BLE_GATTS_VLOC_STACK;
 
     memset(&char_md, 0, sizeof(char_md));
 
-    char_md.char_props.read  = 1;
-    char_md.char_props.write = 1;
-    char_md.p_char_user_desc = NULL;
-    char_md.p_char_pf        = NULL;
-    char_md.p_user_desc_md   = NULL;
-    char_md.p_cccd_md        = NULL;
-    char_md.p_sccd_md        = NULL;
+    char_md.char_props.read   = 1;
+    char_md.char_props.notify = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = &cccd_md;
+    char_md.p_sccd_md         = NULL;
 
     ble_uuid.type = uuid_type;
-    ble_uuid.uuid = LBS_UUID_BYTE4_CHAR;
+    ble_uuid.uuid = LBS_UUID_LEVEL_CHAR;
 
     memset(&attr_md, 0, sizeof(attr_md));
 
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
     attr_md.vloc    = BLE_GATTS_VLOC_STACK;
     attr_md.rd_auth = 0;
     attr_md.wr_auth = 0;
@@ -1908,22 +4599,18 @@ static uint32_t add_cmd4_characteristic(void)
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = 4;
+    attr_char_value.init_len  = 6;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = 4;
+    attr_char_value.max_len   = 6;
     attr_char_value.p_value   = NULL;
 
     return sd_ble_gatts_characteristic_add(svc_handle,
                                            &char_md,
                                            &attr_char_value,
-                                           &data_4byte_handle);
-
+                                           &level_handle);   
 }
-
-//Have 3 characteristics to do, just doing 20 byte for sound pcm file transfer
-static uint32_t add_mult_data_characteristics(void)
+static uint32_t add_telem_characteristic(void)
 {
-    ret_code_t     err_code;
     ble_gatts_char_md_t char_md;
     ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
     ble_gatts_attr_t    attr_char_value;
@@ -1939,7 +4626,6 @@ static uint32_t add_mult_data_characteristics(void)
     memset(&char_md, 0, sizeof(char_md));
 
     char_md.char_props.read   = 1;
-    char_md.char_props.write  = 1;
     char_md.char_props.notify = 1;
     char_md.p_char_user_desc  = NULL;
     char_md.p_char_pf         = NULL;
@@ -1948,14 +4634,14 @@ static uint32_t add_mult_data_characteristics(void)
     char_md.p_sccd_md         = NULL;
 
     ble_uuid.type = uuid_type;
-    ble_uuid.uuid = LBS_UUID_BYTE128_CHAR;
+    ble_uuid.uuid = LBS_UUID_TELEM_CHAR;
 
     memset(&attr_md, 0, sizeof(attr_md));
 
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
-    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
     attr_md.vloc    = BLE_GATTS_VLOC_STACK;
-    attr_md.rd_auth = 1;                      //Have to set this to get an authorize event
+    attr_md.rd_auth = 0;
     attr_md.wr_auth = 0;
     attr_md.vlen    = 0;
 
@@ -1963,20 +4649,19 @@ static uint32_t add_mult_data_characteristics(void)
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = MULTI_LEN;
+    attr_char_value.init_len  = TELEM_LEN;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = MULTI_LEN;
+    attr_char_value.max_len   = TELEM_LEN;
     attr_char_value.p_value   = NULL;
 
     return sd_ble_gatts_characteristic_add(svc_handle,
                                            &char_md,
                                            &attr_char_value,
-                                           &data_128byte_handle);   
+                                           &telem_handle);   
 }
-
-static uint32_t add_data_characteristic(void)
+//Write without response for frames, notify for the acks
+static uint32_t add_frame_characteristic(void)
 {
-    ret_code_t     err_code;
     ble_gatts_char_md_t char_md;
     ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
     ble_gatts_attr_t    attr_char_value;
@@ -1991,8 +4676,9 @@ static uint32_t add_data_characteristic(void)
 
     memset(&char_md, 0, sizeof(char_md));
 
-    char_md.char_props.read   = 1;
-    char_md.char_props.notify = 1;
+    char_md.char_props.write         = 1;
+    char_md.char_props.write_wo_resp = 1;
+    char_md.char_props.notify        = 1;
     char_md.p_char_user_desc  = NULL;
     char_md.p_char_pf         = NULL;
     char_md.p_user_desc_md    = NULL;
@@ -2000,7 +4686,7 @@ static uint32_t add_data_characteristic(void)
     char_md.p_sccd_md         = NULL;
 
     ble_uuid.type = uuid_type;
-    ble_uuid.uuid = LBS_UUID_DATA_CHAR;
+    ble_uuid.uuid = LBS_UUID_FRAME_CHAR;
 
     memset(&attr_md, 0, sizeof(attr_md));
 
@@ -2009,32 +4695,76 @@ static uint32_t add_data_characteristic(void)
     attr_md.vloc    = BLE_GATTS_VLOC_STACK;
     attr_md.rd_auth = 0;
     attr_md.wr_auth = 0;
-    attr_md.vlen    = 0;
+    attr_md.vlen    = 1;
 
     memset(&attr_char_value, 0, sizeof(attr_char_value));
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = sizeof(uint8_t);
+    attr_char_value.init_len  = 2;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = sizeof(uint8_t);
+    attr_char_value.max_len   = MULTI_LEN_MAX;
     attr_char_value.p_value   = NULL;
 
     return sd_ble_gatts_characteristic_add(svc_handle,
                                            &char_md,
                                            &attr_char_value,
-                                           &data_handle);   
+                                           &frame_handle);   
 }
 
-static uint32_t add_data2_characteristic(void)
+//Stream RX, write and write without response like the nus RX characteristic
+static uint32_t add_stream_rx_characteristic(void)
+{
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.write         = 1;
+    char_md.char_props.write_wo_resp = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = NULL;
+    char_md.p_sccd_md         = NULL;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_STREAM_RX_CHAR;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_STACK;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = 1;
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = MULTI_LEN_MAX;
+    attr_char_value.p_value   = NULL;
+
+    return sd_ble_gatts_characteristic_add(svc_handle,
+                                           &char_md,
+                                           &attr_char_value,
+                                           &stream_rx_handle);
+}
+//Stream TX, notify only
+static uint32_t add_stream_tx_characteristic(void)
 {
-    ret_code_t     err_code;
     ble_gatts_char_md_t char_md;
     ble_gatts_attr_md_t cccd_md;          //client characteristic metadata
     ble_gatts_attr_t    attr_char_value;
     ble_uuid_t          ble_uuid;
     ble_gatts_attr_md_t attr_md;
-       
+
     memset(&cccd_md, 0, sizeof(cccd_md));
 
     BLE_GAP_CONN_SEC_MODE_SET_OPEN(&cccd_md.read_perm);
@@ -2043,7 +4773,6 @@ static uint32_t add_data2_characteristic(void)
 
     memset(&char_md, 0, sizeof(char_md));
 
-    char_md.char_props.read   = 1;
     char_md.char_props.notify = 1;
     char_md.p_char_user_desc  = NULL;
     char_md.p_char_pf         = NULL;
@@ -2052,7 +4781,7 @@ static uint32_t add_data2_characteristic(void)
     char_md.p_sccd_md         = NULL;
 
     ble_uuid.type = uuid_type;
-    ble_uuid.uuid = LBS_UUID_BYTE2_CHAR;
+    ble_uuid.uuid = LBS_UUID_STREAM_TX_CHAR;
 
     memset(&attr_md, 0, sizeof(attr_md));
 
@@ -2061,22 +4790,93 @@ static uint32_t add_data2_characteristic(void)
     attr_md.vloc    = BLE_GATTS_VLOC_STACK;
     attr_md.rd_auth = 0;
     attr_md.wr_auth = 0;
-    attr_md.vlen    = 0;
+    attr_md.vlen    = 1;
 
     memset(&attr_char_value, 0, sizeof(attr_char_value));
 
     attr_char_value.p_uuid    = &ble_uuid;
     attr_char_value.p_attr_md = &attr_md;
-    attr_char_value.init_len  = 2;
+    attr_char_value.init_len  = 1;
     attr_char_value.init_offs = 0;
-    attr_char_value.max_len   = 2;
+    attr_char_value.max_len   = MULTI_LEN_MAX;
     attr_char_value.p_value   = NULL;
 
     return sd_ble_gatts_characteristic_add(svc_handle,
                                            &char_md,
                                            &attr_char_value,
-                                           &data_2byte_handle);   
+                                           &stream_tx_handle);
+}
+
+//Second primary service, its slices point straight into p_rx_buffer
+static uint32_t add_clip_service(void)
+{
+    ret_code_t          err_code;
+    ble_gatts_char_md_t char_md;
+    ble_gatts_attr_t    attr_char_value;
+    ble_uuid_t          ble_uuid;
+    ble_gatts_attr_md_t attr_md;
+    uint16_t i;
+
+    ble_uuid.type = uuid_type;
+    ble_uuid.uuid = LBS_UUID_CLIP_SERVICE;
+    err_code = sd_ble_gatts_service_add(BLE_GATTS_SRVC_TYPE_PRIMARY, &ble_uuid, &clip_svc_handle);
+    if (err_code != NRF_SUCCESS)
+      return err_code;
+
+    memset(&char_md, 0, sizeof(char_md));
+
+    char_md.char_props.read   = 1;
+    char_md.p_char_user_desc  = NULL;
+    char_md.p_char_pf         = NULL;
+    char_md.p_user_desc_md    = NULL;
+    char_md.p_cccd_md         = NULL;
+    char_md.p_sccd_md         = NULL;
+
+    memset(&attr_md, 0, sizeof(attr_md));
+
+    BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.read_perm);
+    BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.write_perm);
+    attr_md.vloc    = BLE_GATTS_VLOC_USER;
+    attr_md.rd_auth = 0;
+    attr_md.wr_auth = 0;
+    attr_md.vlen    = 1;                      //zero length while p_rx_buffer isn't the clip
+
+    memset(&attr_char_value, 0, sizeof(attr_char_value));
+
+    attr_char_value.p_uuid    = &ble_uuid;
+    attr_char_value.p_attr_md = &attr_md;
+    attr_char_value.init_len  = CLIP_SLICE_SAMPLES * sizeof(int16_t);
+    attr_char_value.init_offs = 0;
+    attr_char_value.max_len   = CLIP_SLICE_SAMPLES * sizeof(int16_t);
+
+    for(i=0;(i<CLIP_SLICES);i++)
+    {
+      ble_uuid.uuid = LBS_UUID_SLICE_CHAR + i;
+      attr_char_value.p_value = (uint8_t *)&p_rx_buffer[i * CLIP_SLICE_SAMPLES];
+      err_code = sd_ble_gatts_characteristic_add(clip_svc_handle,
+                                                 &char_md,
+                                                 &attr_char_value,
+                                                 &clip_slice_handles[i]);
+      if (err_code != NRF_SUCCESS)
+        return err_code;
+    }
+    return NRF_SUCCESS;
+}
+
+//The flash recorder stages in p_rx_buffer, so from then until the next RAM clip the slices read as empty
+//rather than its leftovers. Only the length changes, the values still live in p_rx_buffer.
+static void clip_slices_valid(uint8_t valid)
+{
+    ble_gatts_value_t value;
+    uint16_t i;
+
+    memset(&value, 0, sizeof(value));
+    value.len     = valid ? CLIP_SLICE_SAMPLES * sizeof(int16_t) : 0;
+    value.p_value = NULL;
+    for(i=0;i<CLIP_SLICES;i++)
+      (void) sd_ble_gatts_value_set(BLE_CONN_HANDLE_INVALID, clip_slice_handles[i].value_handle, &value);
 }
+
 /**@brief Function for initializing services that will be used by the application.
  */
 static void services_init(void)
@@ -2108,6 +4908,30 @@ static void services_init(void)
  
     err_code = add_mult_data_characteristics();
     APP_ERROR_CHECK(err_code);
+
+    err_code = add_event_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_level_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_frame_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_telem_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_stream_rx_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_stream_tx_characteristic();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = NRF_ATFIFO_INIT(m_cmd_fifo);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = add_clip_service();
+    APP_ERROR_CHECK(err_code);
 }
 
 static uint32_t update_remote_byte(void)
@@ -2141,60 +4965,333 @@ static uint32_t update_remote_2byte(void)
     return sd_ble_gatts_hvx(m_conn_p_handle, &params);
 }
 
-//Connection interval set to 50Hz, higher needs better signal strength
-//Each 20ms period, we send 128 bytes, it takes .02s*(32k/128)=5.12s
-static uint32_t update_remote_multi_byte(uint32_t index)
+static uint32_t update_remote_event(uint8_t type, uint8_t id, uint16_t value)
+{
+    ble_gatts_hvx_params_t params;
+    uint16_t len = 4;
+
+    event_val[0] = type;
+    event_val[1] = id;
+    event_val[2] = (uint8_t)(value>>8)&0x00ff;
+    event_val[3] = (uint8_t)(value&0x00ff);
+    if (stream_on == 1)
+      return stream_send(STREAM_CH_EVENT, event_val, 4);
+
+    memset(&params, 0, sizeof(params));
+    params.type   = BLE_GATT_HVX_NOTIFICATION;
+    params.handle = event_handle.value_handle;
+    params.p_data = event_val;
+    params.p_len  = &len;
+
+    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
+}
+
+static uint32_t update_remote_frame_ack(void)
+{
+    ble_gatts_hvx_params_t params;
+    uint16_t len = 2;
+    uint8_t ack[2];
+
+    ack[0] = frame_seq_done;
+    ack[1] = (uint8_t)cmd_dropped;
+    if (stream_on == 1)
+      return stream_send(STREAM_CH_CMD, ack, 2);
+
+    memset(&params, 0, sizeof(params));
+    params.type   = BLE_GATT_HVX_NOTIFICATION;
+    params.handle = frame_handle.value_handle;
+    params.p_data = ack;
+    params.p_len  = &len;
+
+    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
+}
+
+static uint32_t update_remote_level(void)
+{
+    ble_gatts_hvx_params_t params;
+    uint16_t len = 6;
+
+    level_val[0] = (uint8_t)(meter_rms>>8)&0x00ff;
+    level_val[1] = (uint8_t)(meter_rms&0x00ff);
+    level_val[2] = (uint8_t)(meter_peak>>8)&0x00ff;
+    level_val[3] = (uint8_t)(meter_peak&0x00ff);
+    level_val[4] = meter_clips;
+    level_val[5] = mic_gain;
+
+    memset(&params, 0, sizeof(params));
+    params.type   = BLE_GATT_HVX_NOTIFICATION;
+    params.handle = level_handle.value_handle;
+    params.p_data = level_val;
+    params.p_len  = &len;
+
+    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
+}
+
+//Range and lux are the sensor cache's, no TWI here
+static void telem_build(uint8_t step_mode, uint16_t speed)
+{
+    uint32_t ms = telem_ms, steps = step_count, errors;
+
+    errors = xfer_errors + frame_errors + flash_errors + song_fds_errors;
+    telem_val[0] = (uint8_t)(ms>>24);
+    telem_val[1] = (uint8_t)(ms>>16);
+    telem_val[2] = (uint8_t)(ms>>8);
+    telem_val[3] = (uint8_t)ms;
+    telem_val[4] = sensor_range;
+    telem_val[5] = (uint8_t)(sensor_lux>>8);
+    telem_val[6] = (uint8_t)sensor_lux;
+    telem_val[7] = motor_state;
+    telem_val[8] = step_mode;
+    telem_val[9] = (uint8_t)(speed>>8);
+    telem_val[10] = (uint8_t)speed;
+    telem_val[11] = (uint8_t)(steps>>24);
+    telem_val[12] = (uint8_t)(steps>>16);
+    telem_val[13] = (uint8_t)(steps>>8);
+    telem_val[14] = (uint8_t)steps;
+    telem_val[15] = (uint8_t)(meter_rms>>8);
+    telem_val[16] = (uint8_t)meter_rms;
+    telem_val[17] = mic_gain;
+    telem_val[18] = (uint8_t)cmd_dropped;
+    telem_val[19] = (errors > 255) ? 255 : (uint8_t)errors;
+}
+
+static uint32_t update_remote_telem(void)
+{
+    ble_gatts_hvx_params_t params;
+    uint16_t len = TELEM_LEN;
+
+    if (stream_on == 1)
+      return stream_send(STREAM_CH_TELEM, telem_val, TELEM_LEN);
+
+    memset(&params, 0, sizeof(params));
+    params.type   = BLE_GATT_HVX_NOTIFICATION;
+    params.handle = telem_handle.value_handle;
+    params.p_data = telem_val;
+    params.p_len  = &len;
+
+    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
+}
+
+uint32_t xfer_start(void const * p_data, uint32_t len, uint16_t handle)
+{
+    if (xfer_state != XFER_IDLE)
+      return NRF_ERROR_BUSY;
+    xfer.p_data = (uint8_t const *)p_data;
+    xfer.len = len;
+    xfer.pos = 0;
+    xfer.packets = 0;
+    xfer.handle = handle;
+    xfer.packet_len = multi_len;
+    phy_request(BLE_GAP_PHY_2MBPS);
+    app_timer_start(m_xfer_timer, APP_TIMER_TICKS(XFER_WATCHDOG_MS), NULL);
+    xfer.start_ticks = app_timer_cnt_get();
+    CRITICAL_REGION_ENTER();                  //HVN_TX_COMPLETE pumps too
+    xfer_state = XFER_RUN;
+    xfer_pump();
+    CRITICAL_REGION_EXIT();
+    return NRF_SUCCESS;
+}
+
+//Whatever is already in the softdevice's queue still goes out
+void xfer_abort(void)
+{
+    xfer_state = XFER_IDLE;
+    app_timer_stop(m_xfer_timer);
+}
+
+static void xfer_timeout_handler(void * p_context)
+{
+    if (xfer_state == XFER_RUN)
+    {
+      ++xfer_errors;
+      xfer_state = XFER_IDLE;
+    }
+}
+
+//Queued, not acked, but the softdevice only holds a few packets so it's close
+static void xfer_log(void)
+{
+    uint32_t ticks, ms;
+
+    ticks = app_timer_cnt_diff_compute(app_timer_cnt_get(), xfer.start_ticks);
+    app_timer_stop(m_xfer_timer);
+    ms = (uint32_t)((uint64_t)ticks * 1000 / APP_TIMER_CLOCK_FREQ);
+    if (ms == 0)
+      ms = 1;
+    sprintf(buf_out,"Sent %lu B in %lu ms, %lu B/s, %s PHY, %d B packets\r\n",xfer.len,ms,
+            (uint32_t)((uint64_t)xfer.len * 1000 / ms),(xfer.phy == BLE_GAP_PHY_2MBPS) ? "2M" : "1M",xfer.packet_len);
+    TxUART(buf_out);
+}
+
+static void conn_profile_update(void)
+{
+    uint8_t profile;
+
+    if (xfer_state != XFER_IDLE || pi_reads_active == 1)
+      profile = CONN_PROFILE_BULK;
+    else if (motor_state != MOTORS_STOP && motor_state != MOTORS_SLEEP)
+      profile = CONN_PROFILE_CONTROL;
+    else if (conn_idle == 1)
+      profile = CONN_PROFILE_IDLE;
+    else
+      profile = CONN_PROFILE_NORMAL;
+    if (profile == conn_profile || (conn_profile_refused & (1 << profile)))
+      return;
+    if (ble_conn_params_change_conn_params(m_conn_p_handle, &conn_profiles[profile]) == NRF_SUCCESS)
+    {
+      conn_profile = profile;
+      sprintf(buf_out,"Asking for connection profile %d\r\n",profile);
+      TxUART(buf_out);
+    }
+}
+
+//Any write from the host, restarts the idle timer
+static void conn_activity(void)
+{
+    conn_idle = 0;
+    app_timer_start(m_idle_timer, APP_TIMER_TICKS(CONN_IDLE_MS), NULL);
+}
+
+static void idle_timeout_handler(void * p_context)
+{
+    conn_idle = 1;
+}
+
+//period 0 stops it, anything under TELEM_MIN_MS is raised to it
+static void telem_rate(uint16_t period)
+{
+    app_timer_stop(m_telem_timer);
+    telem_due = 0;
+    telem_period = 0;
+    if (period == 0)
+      return;
+    if (period < TELEM_MIN_MS)
+      period = TELEM_MIN_MS;
+    telem_ms = 0;
+    if (app_timer_start(m_telem_timer, APP_TIMER_TICKS(period), NULL) == NRF_SUCCESS)
+    {
+      telem_period = period;
+      sensor_start();
+    }
+}
+
+static void telem_timeout_handler(void * p_context)
+{
+    telem_ms += telem_period;
+    telem_due = TELEM_DUE;
+}
+
+//A new user of the cache, starts the cycle if it isn't going
+static void sensor_start(void)
+{
+    if (sensor_running == 1)
+      return;
+    sensor_running = 1;
+    sensor_step = SENSOR_IDLE;
+    sensor_due = 1;
+}
+
+//Main loop, one step each time the timer is up. A GET_DISTANCE or GET_AMBIENT in between only costs that
+//cycle's reading.
+static void sensor_poll(void)
+{
+    uint32_t next;
+
+    sensor_due = 0;
+    switch (sensor_step)
+    {
+      case SENSOR_IDLE:
+        if (telem_period == 0 && beacon_period == 0)
+        {
+          sensor_running = 0;
+          return;
+        }
+        startDistance();
+        sensor_step = SENSOR_RANGE;
+        next = SENSOR_RANGE_MS;
+        break;
+      case SENSOR_RANGE:
+        sensor_range = readDistance();
+        startAmbientLight(GAIN_1);
+        sensor_step = SENSOR_ALS;
+        next = SENSOR_ALS_MS;
+        break;
+      default:
+        sensor_lux = (uint16_t)readAmbientLight(GAIN_1);
+        sensor_vdd = vdd_read();                //one SAADC sample, tens of us
+        sensor_step = SENSOR_IDLE;
+        next = SENSOR_GAP_MS;
+        break;
+    }
+    if (app_timer_start(m_sensor_timer, APP_TIMER_TICKS(next), NULL) != NRF_SUCCESS)
+      sensor_running = 0;
+}
+
+static void sensor_timeout_handler(void * p_context)
 {
-    ble_gatts_hvx_params_t params;
-    uint16_t len = MULTI_LEN;
-    uint16_t i, j;
+    sensor_due = 1;
+}
 
-    i = j = 0;
-    while(i<len)
-    {
-      data_128byte_val[i+1] = (uint8_t)((p_rx_buffer[index+j]>>8)&0x00ff);
-      data_128byte_val[i] = (uint8_t)(p_rx_buffer[index+j]&0x00ff);
-      i+=2;
-      ++j;
-    }
-    memset(&params, 0, sizeof(params));
-    params.type   = BLE_GATT_HVX_NOTIFICATION;
-    params.handle = data_128byte_handle.value_handle;
-    params.p_data = data_128byte_val;
-    params.p_len  = &len;
+//Nothing if it's already there or a request is out, and 2M isn't asked for again once the peer turned it down
+static void phy_request(uint8_t phy)
+{
+    ble_gap_phys_t phys;
 
-    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
+    if (m_conn_p_handle == BLE_CONN_HANDLE_INVALID || phy_asked != 0 || conn_phy == phy)
+      return;
+    if (phy == BLE_GAP_PHY_2MBPS && phy_2m_refused == 1)
+      return;
+    phys.tx_phys = phy;
+    phys.rx_phys = phy;
+    if (sd_ble_gap_phy_update(m_conn_p_handle, &phys) == NRF_SUCCESS)
+      phy_asked = phy;
 }
 
-//Connection interval set to 50Hz, higher needs better signal strength
-//Each 20ms period, we send 128 bytes, it takes .02s*(32k/128)=5.12s
-static uint32_t update_remote_multi_byte_dft(uint32_t index)
+//Queues packets until the softdevice is full, from xfer_start and then BLE_GATTS_EVT_HVN_TX_COMPLETE
+static void xfer_pump(void)
 {
     ble_gatts_hvx_params_t params;
-    uint16_t len = MULTI_LEN;
-    uint16_t i, j;
+    uint8_t const * p_packet;
+    uint16_t len;
+    uint32_t err_code;
 
-    if (index == 3)
-    {
-      len = 4;
-      for(i=len;(i<MULTI_LEN);i++)
-        data_128byte_val[i] = 0;
-    }
-    i = j = 0;
-    while(i<len)
+    while(xfer_state == XFER_RUN)
     {
-      data_128byte_val[i+1] = (uint8_t)((p_out_buffer[index+j]>>8)&0x00ff);
-      data_128byte_val[i] = (uint8_t)(p_out_buffer[index+j]&0x00ff);
-      i+=2;
-      ++j;
+      if (xfer.pos >= xfer.len)
+      {
+        xfer.phy = conn_phy;
+        xfer_state = XFER_DONE;
+        break;
+      }
+      p_packet = &xfer.p_data[xfer.pos];
+      len = xfer.packet_len;
+      if (xfer.len - xfer.pos < len)          //last packet is padded out, clients count on whole packets
+      {
+        memset(data_128byte_val, 0, len);
+        memcpy(data_128byte_val, p_packet, xfer.len - xfer.pos);
+        p_packet = data_128byte_val;
+      }
+      memset(&params, 0, sizeof(params));
+      params.type   = BLE_GATT_HVX_NOTIFICATION;
+      params.handle = xfer.handle;
+      params.p_data = p_packet;
+      params.p_len  = &len;
+      err_code = sd_ble_gatts_hvx(m_conn_p_handle, &params);
+      if (err_code == NRF_ERROR_RESOURCES)
+        break;                                //queue full, wait for HVN_TX_COMPLETE
+      if (err_code != NRF_SUCCESS)
+      {
+        ++xfer_errors;                        //not connected or notifications off
+        xfer_state = XFER_IDLE;
+        break;
+      }
+      xfer.pos += len;
+      ++xfer.packets;
+      if (!(xfer.packets % 20))
+        led_off();
+      if (!(xfer.packets % 40))
+        led_on();
     }
-    memset(&params, 0, sizeof(params));
-    params.type   = BLE_GATT_HVX_NOTIFICATION;
-    params.handle = data_128byte_handle.value_handle;
-    params.p_data = data_128byte_val;
-    params.p_len  = &len;
-
-    return sd_ble_gatts_hvx(m_conn_p_handle, &params);
 }
 
 /**@brief Function for handling the Connection Parameters Module.
@@ -2214,8 +5311,18 @@ void on_conn_params_evt(ble_conn_params_evt_t * p_evt)
 
     if (p_evt->evt_type == BLE_CONN_PARAMS_EVT_FAILED)
     {
-        err_code = sd_ble_gap_disconnect(m_conn_p_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
-        APP_ERROR_CHECK(err_code);
+        if (conn_profile == CONN_PROFILE_NORMAL)
+        {
+          err_code = sd_ble_gap_disconnect(m_conn_p_handle, BLE_HCI_CONN_INTERVAL_UNACCEPTABLE);
+          APP_ERROR_CHECK(err_code);
+        }
+        else
+        {
+          //central won't do this profile, don't ask again and go back to the normal one
+          conn_profile_refused |= 1 << conn_profile;
+          if (ble_conn_params_change_conn_params(m_conn_p_handle, &conn_profiles[CONN_PROFILE_NORMAL]) == NRF_SUCCESS)
+            conn_profile = CONN_PROFILE_NORMAL;
+        }
     }
 }
 
@@ -2255,22 +5362,216 @@ static void conn_params_init(void)
 
 /**@brief Function for starting advertising.
  */
-static void advertising_start(void)
+//BLE_ADV_MODE_DIRECTED after a dropout, the module skips it without a bond
+static void advertising_start(ble_adv_mode_t mode)
 {
-    ret_code_t           err_code;
-    ble_gap_adv_params_t adv_params;
+    ret_code_t err_code;
 
-    // Start advertising
-    memset(&adv_params, 0, sizeof(adv_params));
+    adv_reconnect = (mode == BLE_ADV_MODE_DIRECTED) ? 1 : 0;
+    err_code = ble_advertising_start(&m_advertising, mode);
+    APP_ERROR_CHECK(err_code);
+}
 
-    adv_params.type        = BLE_GAP_ADV_TYPE_ADV_IND;
-    adv_params.p_peer_addr = NULL;
-    adv_params.fp          = BLE_GAP_ADV_FP_ANY;
-    adv_params.interval    = APP_ADV_INTERVAL;
-    adv_params.timeout     = APP_ADV_TIMEOUT_IN_SECONDS;
+//Mode changes, and the module asking for the bond's address and whitelist as each mode starts
+static void on_adv_evt(ble_adv_evt_t const adv_evt)
+{
+    ret_code_t             err_code;
+    pm_peer_data_bonding_t bonding;
+    ble_gap_addr_t         whitelist_addrs[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+    ble_gap_irk_t          whitelist_irks[BLE_GAP_WHITELIST_ADDR_MAX_COUNT];
+    uint32_t               addr_cnt = BLE_GAP_WHITELIST_ADDR_MAX_COUNT;
+    uint32_t               irk_cnt  = BLE_GAP_WHITELIST_ADDR_MAX_COUNT;
 
-    err_code = sd_ble_gap_adv_start(&adv_params, APP_BLE_CONN_CFG_TAG);
+    switch (adv_evt)
+    {
+        case BLE_ADV_EVT_DIRECTED:
+            TxUART("Directed advertising\r\n");
+            heartbeat_rate(HEARTBEAT_FAST_MS);
+            break;
+
+        // The module drops the flags to BR_EDR_NOT_SUPPORTED for a whitelist and doesn't put them back, and it
+        // sets its own copy of the data from init, so every mode resets the data with the current beacon in it
+        case BLE_ADV_EVT_FAST:
+        case BLE_ADV_EVT_FAST_WHITELIST:
+            TxUART("Fast advertising\r\n");
+            if (adv_evt == BLE_ADV_EVT_FAST)
+              m_advertising.advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+            if (swarm_lead == 0)
+              advertising_init();
+            heartbeat_rate(HEARTBEAT_FAST_MS);
+            break;
+
+        case BLE_ADV_EVT_SLOW:
+        case BLE_ADV_EVT_SLOW_WHITELIST:
+            TxUART("Slow advertising\r\n");
+            if (adv_evt == BLE_ADV_EVT_SLOW)
+              m_advertising.advdata.flags = BLE_GAP_ADV_FLAGS_LE_ONLY_GENERAL_DISC_MODE;
+            if (swarm_lead == 0)
+              advertising_init();
+            heartbeat_rate(HEARTBEAT_SLOW_MS);
+            break;
+
+        case BLE_ADV_EVT_IDLE:
+            heartbeat_rate(0);
+            break;
+
+        case BLE_ADV_EVT_PEER_ADDR_REQUEST:
+            if (adv_reconnect == 1 && bond_peer != PM_PEER_ID_INVALID &&
+                pm_peer_data_bonding_load(bond_peer, &bonding) == NRF_SUCCESS)
+            {
+                err_code = ble_advertising_peer_addr_reply(&m_advertising, &bonding.peer_ble_id.id_addr_info);
+                APP_ERROR_CHECK(err_code);
+            }
+            break;
+
+        case BLE_ADV_EVT_WHITELIST_REQUEST:
+            // Only the fast phase after a dropout is kept for the bond, slow is open so anyone can take over
+            if (adv_reconnect == 1 && bond_peer != PM_PEER_ID_INVALID &&
+                m_advertising.adv_mode_current == BLE_ADV_MODE_FAST)
+            {
+                // Can't change while a scan is using them, the reply is empty then and it's open
+                (void) pm_whitelist_set(&bond_peer, 1);
+                (void) pm_device_identities_list_set(&bond_peer, 1);
+                if (pm_whitelist_get(whitelist_addrs, &addr_cnt, whitelist_irks, &irk_cnt) != NRF_SUCCESS)
+                  addr_cnt = irk_cnt = 0;
+            }
+            else
+            {
+                addr_cnt = irk_cnt = 0;
+            }
+            err_code = ble_advertising_whitelist_reply(&m_advertising, whitelist_addrs, addr_cnt,
+                                                       whitelist_irks, irk_cnt);
+            APP_ERROR_CHECK(err_code);
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void adv_error_handler(uint32_t nrf_error)
+{
+    APP_ERROR_HANDLER(nrf_error);
+}
+
+//0 stops it, the not connected loop blinks the led and sleeps in between
+static void heartbeat_rate(uint16_t period)
+{
+    app_timer_stop(m_heartbeat_timer);
+    if (period != 0)
+      (void) app_timer_start(m_heartbeat_timer, APP_TIMER_TICKS(period), NULL);
+}
+
+static void heartbeat_timeout_handler(void * p_context)
+{
+    heartbeat_due = 1;
+}
+
+static void peer_manager_init(void)
+{
+    ret_code_t err_code;
+
+    err_code = pm_init();
+    APP_ERROR_CHECK(err_code);
+
+    err_code = pm_register(pm_evt_handler);
     APP_ERROR_CHECK(err_code);
+
+    bond_peer = pm_next_peer_id_get(PM_PEER_ID_INVALID);
+    bond_mode_set((bond_peer != PM_PEER_ID_INVALID) ? 1 : 0);
+}
+
+//Off refuses pairing and deletes the bond
+static void bond_mode_set(uint8_t on)
+{
+    ret_code_t           err_code;
+    ble_gap_sec_params_t sec_param;
+
+    bond_mode = on;
+    if (on == 1)
+    {
+        memset(&sec_param, 0, sizeof(ble_gap_sec_params_t));
+        sec_param.bond           = 1;
+        sec_param.mitm           = 0;
+        sec_param.lesc           = 0;
+        sec_param.keypress       = 0;
+        sec_param.io_caps        = BLE_GAP_IO_CAPS_NONE;
+        sec_param.oob            = 0;
+        sec_param.min_key_size   = 7;
+        sec_param.max_key_size   = 16;
+        sec_param.kdist_own.enc  = 1;
+        sec_param.kdist_own.id   = 1;
+        sec_param.kdist_peer.enc = 1;
+        sec_param.kdist_peer.id  = 1;
+        err_code = pm_sec_params_set(&sec_param);
+        APP_ERROR_CHECK(err_code);
+        TxUART("Bonding on\r\n");
+    }
+    else
+    {
+        err_code = pm_sec_params_set(NULL);
+        APP_ERROR_CHECK(err_code);
+        if (bond_peer != PM_PEER_ID_INVALID)
+        {
+            bond_peer = PM_PEER_ID_INVALID;
+            (void) pm_peers_delete();
+        }
+        TxUART("Bonding off\r\n");
+    }
+}
+
+//From the softdevice event interrupt and FDS events
+static void pm_evt_handler(pm_evt_t const * p_evt)
+{
+    pm_peer_id_t         peer_id;
+    pm_conn_sec_config_t config;
+
+    switch (p_evt->evt_id)
+    {
+        case PM_EVT_BONDED_PEER_CONNECTED:
+            TxUART("Bonded controller\r\n");
+            break;
+
+        case PM_EVT_CONN_SEC_SUCCEEDED:
+            if (p_evt->params.conn_sec_succeeded.procedure != PM_LINK_SECURED_PROCEDURE_BONDING ||
+                p_evt->peer_id == PM_PEER_ID_INVALID)
+                break;
+            // A new controller, it's the only one kept
+            bond_armed = 0;
+            bond_peer = p_evt->peer_id;
+            peer_id = pm_next_peer_id_get(PM_PEER_ID_INVALID);
+            while (peer_id != PM_PEER_ID_INVALID)
+            {
+                if (peer_id != bond_peer)
+                    (void) pm_peer_delete(peer_id);
+                peer_id = pm_next_peer_id_get(peer_id);
+            }
+            sprintf(buf_out,"Bonded, peer %d\r\n",bond_peer);
+            TxUART(buf_out);
+            break;
+
+        case PM_EVT_CONN_SEC_CONFIG_REQ:
+            // The phone lost its keys, or something has its address, only when BOND_MODE was just turned on
+            config.allow_repairing = (bond_armed == 1);
+            pm_conn_sec_config_reply(p_evt->conn_handle, &config);
+            break;
+
+        case PM_EVT_CONN_SEC_FAILED:
+            sprintf(buf_out,"Pairing failed %d\r\n",p_evt->params.conn_sec_failed.error);
+            TxUART(buf_out);
+            break;
+
+        case PM_EVT_STORAGE_FULL:
+            (void) fds_gc();
+            break;
+
+        case PM_EVT_ERROR_UNEXPECTED:
+            APP_ERROR_CHECK(p_evt->params.error_unexpected.error);
+            break;
+
+        default:
+            break;
+    }
 }
 
 /**@brief Function for handling BLE_GAP_EVT_CONNECTED events.
@@ -2292,6 +5593,7 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
 {
     ret_code_t err_code;
     uint16_t i, j;
+    int8_t slot;
 
     ble_gap_evt_t const * p_gap_evt = &p_ble_evt->evt.gap_evt;
     m_gap_role = p_gap_evt->params.connected.role;
@@ -2304,18 +5606,43 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             {
               (void) sd_ble_gap_adv_stop();
               m_conn_p_handle = p_gap_evt->conn_handle;
+              conn_phy = BLE_GAP_PHY_1MBPS;
+              phy_asked = 0;
+              phy_2m_refused = 0;
+              conn_profile = CONN_PROFILE_NORMAL;
+              conn_profile_refused = 0;
+              conn_interval = p_gap_evt->params.connected.conn_params.max_conn_interval;
+              conn_activity();
               TxUART("Connected Peripheral\r\n");
+              heartbeat_rate(0);
               BLE_P_Connected = 1;
             }
             else
             {
               if (m_gap_role == BLE_GAP_ROLE_CENTRAL)
               {
-                m_conn_c_handle = p_gap_evt->conn_handle;
-                err_code = ble_db_discovery_start(&m_db_disc, p_gap_evt->conn_handle);
+                relay_connecting = 0;
+                slot = relay_find(BLE_CONN_HANDLE_INVALID);   //on_adv_report only connects with a slot free
+                if (slot < 0)
+                {
+                  (void) sd_ble_gap_disconnect(p_gap_evt->conn_handle, BLE_HCI_REMOTE_USER_TERMINATED_CONNECTION);
+                  break;
+                }
+                i = slot;
+                relay_known_add(&p_gap_evt->params.connected.peer_addr);
+                relay_links[i].conn_handle = p_gap_evt->conn_handle;
+                relay_links[i].cmd_handle = relay_links[i].cmd4_handle = 0;
+                relay_links[i].head = relay_links[i].tail = 0;
+                ++relay_cnt;
+                err_code = ble_db_discovery_start(&m_db_disc[i], p_gap_evt->conn_handle);
                 APP_ERROR_CHECK(err_code);
                 BLE_C_Connected = 1;
-                TxUART("Connect Central\r\n");
+                update_remote_event(EVENT_RELAY, i, 1);
+                sprintf(buf_out,"Connect Central, relay %d\r\n",i);
+                TxUART(buf_out);
+                if (relay_cnt >= RELAY_LINKS)
+                  relay_scanning = 0;
+                scan_start();                             //keep looking for more, or back to following
               }
             }
         }
@@ -2327,16 +5654,27 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             {
               TxUART("Disconnected peripheral\r\n");
               m_conn_p_handle = BLE_CONN_HANDLE_INVALID;
+              xfer_abort();                 //no more HVN_TX_COMPLETEs to drive it
+              bond_armed = 0;
+              app_timer_stop(m_idle_timer);
+              telem_rate(0);
+              stream_reset(0);
+              swarm_lead_set(0);                    //connectable advertising needs the advertiser back
+              (void) sd_ble_gap_adv_stop();         //the beacon's, if it was on
               BLE_P_Connected = 0;
-              advertising_start();
+              advertising_start(BLE_ADV_MODE_DIRECTED);   //straight back to a bonded controller
             }
             else
             {
-              if (p_gap_evt->conn_handle == m_conn_c_handle)
+              i = relay_find(p_gap_evt->conn_handle);
+              if (i < RELAY_LINKS)
               {
-                TxUART("Disconnected central\r\n");
-                m_conn_c_handle = BLE_CONN_HANDLE_INVALID;
-                BLE_C_Connected = 0;
+                relay_links[i].conn_handle = BLE_CONN_HANDLE_INVALID;
+                --relay_cnt;
+                BLE_C_Connected = (relay_cnt != 0) ? 1 : 0;
+                update_remote_event(EVENT_RELAY, i, 0);
+                sprintf(buf_out,"Disconnected central, relay %d\r\n",i);
+                TxUART(buf_out);
               }
             }
        }
@@ -2351,7 +5689,10 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             if (p_gap_evt->params.timeout.src == BLE_GAP_TIMEOUT_SRC_CONN)
             {
                 TxUART("Connection request timed out.\r\n");
+                relay_connecting = 0;
+                scan_start();
             }
+            // Advertising timeouts are the ble_advertising module's, it moves on to the next mode
             break;
 
         case BLE_GAP_EVT_CONN_PARAM_UPDATE_REQUEST:
@@ -2362,16 +5703,6 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             APP_ERROR_CHECK(err_code);
             break;
         
-        case BLE_GAP_EVT_SEC_PARAMS_REQUEST:
-            // Pairing not supported
-
-            err_code = sd_ble_gap_sec_params_reply(p_ble_evt->evt.gap_evt.conn_handle,
-                                                   BLE_GAP_SEC_STATUS_PAIRING_NOT_SUPP,
-                                                   NULL,
-                                                   NULL);
-            APP_ERROR_CHECK(err_code);
-            break;
-
 #ifndef S140
         case BLE_GAP_EVT_PHY_UPDATE_REQUEST:
         {
@@ -2385,10 +5716,29 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
         } break;
 #endif
 
-        case BLE_GATTS_EVT_SYS_ATTR_MISSING:
-            // No system attributes have been stored.
-            err_code = sd_ble_gatts_sys_attr_set(p_ble_evt->evt.gap_evt.conn_handle, NULL, 0, 0);
-            APP_ERROR_CHECK(err_code);
+        case BLE_GAP_EVT_CONN_PARAM_UPDATE:
+            if (p_gap_evt->conn_handle != m_conn_p_handle)
+              break;
+            conn_interval = p_gap_evt->params.conn_param_update.conn_params.max_conn_interval;
+            conn_params_report = 1;   //main loop tells the host
+            break;
+
+        case BLE_GAP_EVT_PHY_UPDATE:
+            if (p_gap_evt->conn_handle != m_conn_p_handle)
+              break;
+            if (p_gap_evt->params.phy_update.status == BLE_HCI_STATUS_CODE_SUCCESS)
+              conn_phy = p_gap_evt->params.phy_update.tx_phy;
+            if (phy_asked == BLE_GAP_PHY_2MBPS && conn_phy != BLE_GAP_PHY_2MBPS)
+              phy_2m_refused = 1;
+            phy_asked = 0;
+            sprintf(buf_out,"PHY %s\r\n",(conn_phy == BLE_GAP_PHY_2MBPS) ? "2M" : "1M");
+            TxUART(buf_out);
+            break;
+
+        case BLE_GATTC_EVT_WRITE_CMD_TX_COMPLETE:
+            i = relay_find(p_ble_evt->evt.gattc_evt.conn_handle);
+            if (i < RELAY_LINKS)
+              relay_pump(i);
             break;
 
         case BLE_GATTC_EVT_TIMEOUT:
@@ -2421,12 +5771,19 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
             {
               if (pi_reads_active == 1)
               {
-                  //This is a little tricky, i increments by 2 and goes to 20, j increments by 1 and goes to 10
+                  //This is a little tricky, i increments by 2 and goes to multi_len, j increments by 1 and goes to half that
                   i = j = 0;
-                  while(i<MULTI_LEN)
+                  while(i<multi_len)
                   {
-                    data_128byte_val[i+1] = (uint8_t)((p_rx_buffer[load_buffer_offset+j]>>8)&0x00ff);
-                    data_128byte_val[i] = (uint8_t)(p_rx_buffer[load_buffer_offset+j]&0x00ff);
+                    if (load_buffer_offset+j < sound_len)
+                    {
+                      data_128byte_val[i+1] = (uint8_t)((p_sound[load_buffer_offset+j]>>8)&0x00ff);
+                      data_128byte_val[i] = (uint8_t)(p_sound[load_buffer_offset+j]&0x00ff);
+                    }
+                    else
+                    {
+                      data_128byte_val[i+1] = data_128byte_val[i] = 0;   //past the end, packets are bigger now
+                    }
                     i+=2;
                     ++j;
                   }
@@ -2435,19 +5792,19 @@ void ble_evt_handler(ble_evt_t const * p_ble_evt, void * p_context)
                   //sound_value.p_value = data_128byte_val;
                   //sd_ble_gatts_value_set(m_conn_handle,data_128byte_handle.value_handle,&sound_value);
                   
-                  load_buffer_offset += MULTI_LEN/2; //increment by 10
+                  load_buffer_offset += multi_len/2; //increment by 10 at the default MTU
   
                   auth_reply.type = BLE_GATTS_AUTHORIZE_TYPE_READ;
                   auth_reply.params.read.gatt_status = BLE_GATT_STATUS_SUCCESS;
                   auth_reply.params.read.update = 1;
-                  auth_reply.params.read.len = MULTI_LEN;
+                  auth_reply.params.read.len = multi_len;
                   auth_reply.params.read.offset = 0;
                   auth_reply.params.read.p_data = data_128byte_val;
                   err_code = sd_ble_gatts_rw_authorize_reply(p_ble_evt->evt.gatts_evt.conn_handle,
                                                                &auth_reply);
                   if (err_code != NRF_SUCCESS)
                   {
-                    load_buffer_offset -= MULTI_LEN/2;    //decrement for retry, does NRF do retry after failure?
+                    load_buffer_offset -= multi_len/2;    //decrement for retry, does NRF do retry after failure?
                   }                 
                   return;
               }
@@ -2494,18 +5851,18 @@ void on_write(ble_evt_t const * p_ble_evt)
 {    
     ble_gatts_evt_write_t const * p_evt_write = &p_ble_evt->evt.gatts_evt.params.write;
  
+    conn_activity();
     if (p_evt_write->handle == cmd_handle.value_handle)
     {
         if (p_evt_write->len == 1)
         {
-          cmd_value = p_evt_write->data[0];
-          new_cmd = 1;
-          sprintf(buf_out,"cmd = %x\r\n",cmd_value);
+          cmd_put(CMD_SRC_BYTE, 0, p_evt_write->data[0], 0, 0, 0);
+          sprintf(buf_out,"cmd = %x\r\n",p_evt_write->data[0]);
           TxUART(buf_out);
         }
         else
         {
-          sprintf(buf_out,"cmd %x but wrong length = %d\r\n",cmd_value,p_evt_write->len);
+          sprintf(buf_out,"cmd %x but wrong length = %d\r\n",p_evt_write->data[0],p_evt_write->len);
           TxUART(buf_out);
         }
     }else{
@@ -2513,20 +5870,29 @@ void on_write(ble_evt_t const * p_ble_evt)
         {
           if (p_evt_write->len == 4)
           {
-           cmd_value = p_evt_write->data[0];
-           motors_speed = (((uint16_t)p_evt_write->data[1])<<8) | p_evt_write->data[2];
-           motors_code = p_evt_write->data[3]; //not sure what to do with this yet
-           new_cmd = 1;
-           sprintf(buf_out,"cmd = %x speed = %d code = %d\r\n",cmd_value,motors_speed,motors_code);
+           cmd_put(CMD_SRC_4BYTE, 0, p_evt_write->data[0], 1,
+                   (((uint16_t)p_evt_write->data[1])<<8) | p_evt_write->data[2], p_evt_write->data[3]);
+           sprintf(buf_out,"cmd = %x speed = %d code = %d\r\n",p_evt_write->data[0],
+                   (((uint16_t)p_evt_write->data[1])<<8) | p_evt_write->data[2],p_evt_write->data[3]);
            TxUART(buf_out);
           }else{
            sprintf(buf_out,"4 byte command wrong length = %d\r\n",p_evt_write->len);
            TxUART(buf_out);
           }
         }else{
-          if (p_evt_write->handle == data_handle.value_handle)
+          if (p_evt_write->handle == frame_handle.value_handle)
+          {
+            frame_parse(p_evt_write->data, p_evt_write->len);
+          }else if (p_evt_write->handle == stream_rx_handle.value_handle)
+          {
+            stream_parse(p_evt_write->data, p_evt_write->len);
+          }else if (p_evt_write->handle == stream_tx_handle.cccd_handle && p_evt_write->len == 2)
+          {
+            stream_reset(ble_srv_is_notification_enabled(p_evt_write->data) ? 1 : 0);
+            sprintf(buf_out,"Stream %s\r\n",stream_on ? "on" : "off");
+            TxUART(buf_out);
+          }else if (p_evt_write->handle == data_handle.value_handle)
           {
-            new_cmd = 2;
             sprintf(buf_out,"data, unexpected write, handle %d, len = %d\r\n",p_evt_write->handle,p_evt_write->len);
             TxUART(buf_out);
           }else{
@@ -2537,6 +5903,252 @@ void on_write(ble_evt_t const * p_ble_evt)
     }
 }
 
+//Runs in on_write, the softdevice event interrupt. A frame that doesn't end on a record boundary still has
+//its whole records queued.
+static void frame_parse(uint8_t const * p_data, uint16_t len)
+{
+    struct cmd_struct rec;
+    uint16_t i = 0;
+
+    while(i + 2 <= len)
+    {
+      rec.seq = p_data[i];
+      rec.cmd = p_data[i+1] & ~FRAME_ARGS;
+      rec.args = (p_data[i+1] & FRAME_ARGS) ? 1 : 0;
+      rec.speed = 0;
+      rec.code = 0;
+      i += 2;
+      if (rec.args == 1)
+      {
+        if (i + 3 > len)
+          break;
+        rec.speed = (((uint16_t)p_data[i])<<8) | p_data[i+1];
+        rec.code = p_data[i+2];
+        i += 3;
+      }
+      cmd_put(CMD_SRC_FRAME, rec.seq, rec.cmd, rec.args, rec.speed, rec.code);
+    }
+    if (i != len)
+      ++frame_errors;
+}
+
+//From on_write and the main loop (tones), returns 0 if the queue was full
+static uint8_t cmd_put(uint8_t src, uint8_t seq, uint8_t cmd, uint8_t args, uint16_t speed, uint8_t code)
+{
+    struct cmd_struct rec;
+    uint8_t ok;
+
+    rec.src = src;
+    rec.seq = seq;
+    rec.cmd = cmd;
+    rec.args = args;
+    rec.speed = speed;
+    rec.code = code;
+    ok = (nrf_atfifo_alloc_put(m_cmd_fifo, &rec, sizeof(rec), NULL) == NRF_SUCCESS) ? 1 : 0;
+    CRITICAL_REGION_ENTER();                  //counters have two writers
+    if (ok == 1)
+    {
+      ++cmd_queued;
+      if (cmd_queued - cmd_run > cmd_depth_max)
+        cmd_depth_max = cmd_queued - cmd_run;
+    }
+    else
+    {
+      ++cmd_dropped;
+    }
+    CRITICAL_REGION_EXIT();
+    return ok;
+}
+
+//Main loop side, loads the next command into cmd_value, and the args into motors_speed and motors_code if
+//it brought any, then sets new_cmd. Returns 1 if there was one.
+static uint8_t cmd_next(void)
+{
+    struct cmd_struct rec;
+
+    if (nrf_atfifo_get_free(m_cmd_fifo, &rec, sizeof(rec), NULL) != NRF_SUCCESS)
+      return 0;
+    ++cmd_run;
+    cmd_value = rec.cmd;
+    cmd_args = rec.args;
+    cmd_src = rec.src;
+    if (rec.args == 1)
+    {
+      motors_speed = rec.speed;
+      motors_code = rec.code;
+    }
+    if (rec.src == CMD_SRC_FRAME)
+    {
+      frame_seq_running = rec.seq;
+      frame_running = 1;
+    }
+    new_cmd = 1;
+    return 1;
+}
+
+//Credits back to the defaults, and anything queued or half sent is thrown away
+static void stream_reset(uint8_t on)
+{
+    uint8_t i;
+
+    CRITICAL_REGION_ENTER();
+    stream_on = on;
+    stream_head = stream_tail = 0;
+    stream_bulk_busy = stream_bulk_done = 0;
+    for(i=0;i<STREAM_CHANNELS;i++)
+      stream_credits[i] = STREAM_CREDIT_ANY;
+    stream_credits[STREAM_CH_LOG] = 0;
+    CRITICAL_REGION_EXIT();
+}
+
+//The frame goes in whole or not at all. NRF_ERROR_RESOURCES when there's no room, same as a full
+//softdevice queue so callers retry the same way, NRF_ERROR_BUSY when the channel has no credits.
+static uint32_t stream_put(uint8_t ch, uint8_t const * p_src, uint16_t len)
+{
+    uint32_t err_code = NRF_SUCCESS;
+    uint16_t i;
+
+    if (len > 255)
+      return NRF_ERROR_INVALID_LENGTH;
+    CRITICAL_REGION_ENTER();
+    if (stream_on == 0)
+    {
+      err_code = NRF_ERROR_INVALID_STATE;
+    }
+    else if (stream_credits[ch] == 0)
+    {
+      err_code = NRF_ERROR_BUSY;
+    }
+    else if (STREAM_TX_SIZE - (uint16_t)(stream_head - stream_tail) < len + STREAM_HEADER)
+    {
+      err_code = NRF_ERROR_RESOURCES;
+    }
+    else
+    {
+      if (stream_credits[ch] != STREAM_CREDIT_ANY)
+        --stream_credits[ch];
+      stream_tx[stream_head++ & (STREAM_TX_SIZE-1)] = ch;
+      stream_tx[stream_head++ & (STREAM_TX_SIZE-1)] = (uint8_t)len;
+      for(i=0;i<len;i++)
+        stream_tx[stream_head++ & (STREAM_TX_SIZE-1)] = p_src[i];
+    }
+    CRITICAL_REGION_EXIT();
+    return err_code;
+}
+
+//Any context, counts what didn't go
+uint32_t stream_send(uint8_t ch, void const * p_data, uint16_t len)
+{
+    uint32_t err_code = stream_put(ch, (uint8_t const *)p_data, len);
+
+    if (err_code != NRF_SUCCESS)
+      ++stream_drops;
+    return err_code;
+}
+
+//Main loop, a buffer too big for stream_tx. stream_pump frames it STREAM_CHUNK at a time as room and
+//credits allow, then sets stream_bulk_done for the main loop's EVENT_STREAM.
+uint32_t stream_bulk_start(uint8_t ch, void const * p_data, uint32_t len)
+{
+    if (stream_on == 0)
+      return NRF_ERROR_INVALID_STATE;
+    if (stream_bulk_busy == 1 || stream_bulk_done == 1)
+      return NRF_ERROR_BUSY;
+    stream_bulk.p_data = (uint8_t const *)p_data;
+    stream_bulk.len = len;
+    stream_bulk.pos = 0;
+    stream_bulk.frames = 0;
+    stream_bulk.ch = ch;
+    phy_request(BLE_GAP_PHY_2MBPS);
+    stream_bulk_busy = 1;
+    stream_pump();
+    return NRF_SUCCESS;
+}
+
+//The packetizer, from the main loop and BLE_GATTS_EVT_HVN_TX_COMPLETE. Tops stream_tx up from the bulk
+//buffer, then queues multi_len packets of whatever is in stream_tx until the softdevice is full.
+static void stream_pump(void)
+{
+    ble_gatts_hvx_params_t params;
+    uint8_t packet[MULTI_LEN_MAX];
+    uint16_t len, i;
+    uint32_t chunk;
+
+    CRITICAL_REGION_ENTER();
+    while(stream_bulk_busy == 1)
+    {
+      chunk = stream_bulk.len - stream_bulk.pos;
+      if (chunk > STREAM_CHUNK)
+        chunk = STREAM_CHUNK;
+      if (stream_put(stream_bulk.ch, stream_bulk.p_data + stream_bulk.pos, chunk) != NRF_SUCCESS)
+        break;                                //no room or no credits, try again next pump
+      stream_bulk.pos += chunk;
+      ++stream_bulk.frames;
+      if (stream_bulk.pos >= stream_bulk.len)
+      {
+        stream_bulk_busy = 0;
+        stream_bulk_done = 1;
+      }
+    }
+    while(stream_head != stream_tail)
+    {
+      len = stream_head - stream_tail;
+      if (len > multi_len)
+        len = multi_len;
+      for(i=0;i<len;i++)
+        packet[i] = stream_tx[(stream_tail + i) & (STREAM_TX_SIZE-1)];
+      memset(&params, 0, sizeof(params));
+      params.type   = BLE_GATT_HVX_NOTIFICATION;
+      params.handle = stream_tx_handle.value_handle;
+      params.p_data = packet;
+      params.p_len  = &len;
+      if (sd_ble_gatts_hvx(m_conn_p_handle, &params) != NRF_SUCCESS)
+        break;                                //queue full, HVN_TX_COMPLETE comes back here
+      stream_tail += len;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+//Runs in on_write. A frame cut short by the end of the write is dropped and counted.
+static void stream_parse(uint8_t const * p_data, uint16_t len)
+{
+    uint16_t i = 0, j;
+    uint8_t ch, n, c;
+
+    while(i + STREAM_HEADER <= len)
+    {
+      ch = p_data[i];
+      n = p_data[i+1];
+      i += STREAM_HEADER;
+      if (i + n > len)
+        break;
+      switch(ch)
+      {
+        case STREAM_CH_CTRL:
+          for(j=0;j+2<=n;j+=2)
+          {
+            if (p_data[i+j] >= STREAM_CHANNELS)
+              continue;
+            c = p_data[i+j];
+            if (p_data[i+j+1] == 0 || p_data[i+j+1] == STREAM_CREDIT_ANY || stream_credits[c] == STREAM_CREDIT_ANY)
+              stream_credits[c] = p_data[i+j+1];          //a count on an uncounted channel starts counting
+            else
+              stream_credits[c] = MIN(STREAM_CREDIT_ANY - 1, stream_credits[c] + p_data[i+j+1]);
+          }
+          break;
+        case STREAM_CH_CMD:
+          frame_parse(&p_data[i], n);
+          break;
+        default:
+          ++stream_rx_errors;
+          break;
+      }
+      i += n;
+    }
+    if (i != len)
+      ++stream_rx_errors;
+}
+
 void ble_skoobot_p_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
 {
 
@@ -2546,6 +6158,13 @@ void ble_skoobot_p_on_ble_evt(ble_evt_t const * p_ble_evt, void * p_context)
             on_write(p_ble_evt);
             break;
 
+        case BLE_GATTS_EVT_HVN_TX_COMPLETE:
+            if (xfer_state == XFER_RUN)
+              xfer_pump();
+            if (stream_on == 1)
+              stream_pump();
+            break;
+
         default:
             // No implementation needed.
             break;
@@ -2583,10 +6202,40 @@ static void ble_stack_init(void)
     err_code = nrf_sdh_ble_default_cfg_set(APP_BLE_CONN_CFG_TAG, &ram_start);
     APP_ERROR_CHECK(err_code);
 
+    // The default tag is sized for every link, give it just the peripheral link and put the relay links on
+    // their own tag with a 23 byte MTU and a short event, so RELAY_LINKS of them fit in RAM and in the radio schedule
+    ble_cfg_t ble_cfg;
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = APP_BLE_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gap_conn_cfg.conn_count = NRF_SDH_BLE_PERIPHERAL_LINK_COUNT;
+    ble_cfg.conn_cfg.params.gap_conn_cfg.event_length = NRF_SDH_BLE_GAP_EVENT_LENGTH;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GAP, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = RELAY_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gap_conn_cfg.conn_count = RELAY_LINKS;
+    ble_cfg.conn_cfg.params.gap_conn_cfg.event_length = RELAY_EVENT_LENGTH;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GAP, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
+    memset(&ble_cfg, 0, sizeof(ble_cfg));
+    ble_cfg.conn_cfg.conn_cfg_tag = RELAY_CONN_CFG_TAG;
+    ble_cfg.conn_cfg.params.gatt_conn_cfg.att_mtu = BLE_GATT_ATT_MTU_DEFAULT;
+    err_code = sd_ble_cfg_set(BLE_CONN_CFG_GATT, &ble_cfg, ram_start);
+    APP_ERROR_CHECK(err_code);
+
     // Enable BLE stack.
     err_code = nrf_sdh_ble_enable(&ram_start);
     APP_ERROR_CHECK(err_code);
 
+    // Let connection events run past the event length when there's more to send, bulk transfers need it
+    ble_opt_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.common_opt.conn_evt_ext.enable = 1;
+    err_code = sd_ble_opt_set(BLE_COMMON_OPT_CONN_EVT_EXT, &opt);
+    APP_ERROR_CHECK(err_code);
+
     // Register a handler for BLE events.
     NRF_SDH_BLE_OBSERVER(m_ble_observer, APP_BLE_OBSERVER_PRIO, ble_evt_handler, NULL);
 }
@@ -2601,7 +6250,7 @@ void log_init(void)
 /*
 *@brief Function for the Power Manager.
  */
-void power_manage(void)
+static void power_manage(void)
 {
     ret_code_t err_code = sd_app_evt_wait();
     APP_ERROR_CHECK(err_code);
@@ -2615,4 +6264,22 @@ void timers_init(void)
     // Initialize timer module, making it use the scheduler
     ret_code_t err_code = app_timer_init();
     APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_xfer_timer, APP_TIMER_MODE_SINGLE_SHOT, xfer_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_idle_timer, APP_TIMER_MODE_SINGLE_SHOT, idle_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_telem_timer, APP_TIMER_MODE_REPEATED, telem_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_sensor_timer, APP_TIMER_MODE_SINGLE_SHOT, sensor_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_beacon_timer, APP_TIMER_MODE_REPEATED, beacon_timeout_handler);
+    APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_heartbeat_timer, APP_TIMER_MODE_REPEATED, heartbeat_timeout_handler);
+    APP_ERROR_CHECK(err_code);
 }
\ No newline at end of file
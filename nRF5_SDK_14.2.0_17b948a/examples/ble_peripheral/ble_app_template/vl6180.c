@@ -77,14 +77,33 @@ void VL6180xDefautSettings(void)
 
 uint8_t getDistance(void)
 {
-  VL6180x_setRegister(VL6180X_SYSRANGE_START, 0x01); //Start Single shot mode
+  startDistance();
   nrf_delay_ms(10);
+  return readDistance();
+}
+
+//Split so a caller can do something else for the 10ms
+void startDistance(void)
+{
+  VL6180x_setRegister(VL6180X_SYSRANGE_START, 0x01); //Start Single shot mode
+}
+
+uint8_t readDistance(void)
+{
   VL6180x_setRegister(VL6180X_SYSTEM_INTERRUPT_CLEAR, 0x07);
   //	return distance;
   return VL6180x_getRegister(VL6180X_RESULT_RANGE_VAL);
 }
 
 float32_t getAmbientLight(uint8_t VL6180X_ALS_GAIN)
+{
+  startAmbientLight(VL6180X_ALS_GAIN);
+  nrf_delay_ms(100); //give it time... 
+  return readAmbientLight(VL6180X_ALS_GAIN);
+}
+
+//Split so a caller can do something else for the 100ms integration
+void startAmbientLight(uint8_t VL6180X_ALS_GAIN)
 {
   //First load in Gain we are using, do it every time in case someone changes it on us.
   //Note: Upper nibble shoudl be set to 0x4 i.e. for ALS gain of 1.0 write 0x46
@@ -92,9 +111,10 @@ float32_t getAmbientLight(uint8_t VL6180X_ALS_GAIN)
 
   //Start ALS Measurement 
   VL6180x_setRegister(VL6180X_SYSALS_START, 0x01);
+}
 
-  nrf_delay_ms(100); //give it time... 
-
+float32_t readAmbientLight(uint8_t VL6180X_ALS_GAIN)
+{
   VL6180x_setRegister(VL6180X_SYSTEM_INTERRUPT_CLEAR, 0x07);
 
   //Retrieve the Raw ALS value from the sensor
@@ -119,8 +119,12 @@ void VL6180xDefautSettings(void); //Load default settings to get started.
 // GAIN_1      // Actual ALS Gain of 1.01
 // GAIN_40     // Actual ALS Gain of 40
 float32_t getAmbientLight(uint8_t gain);
+void startAmbientLight(uint8_t gain);       //getAmbientLight without the wait, read 100ms later
+float32_t readAmbientLight(uint8_t gain);
 //Get Distance and report in mm
 uint8_t getDistance(void); 
+void startDistance(void);                   //getDistance without the wait, read 10ms later
+uint8_t readDistance(void);
 void VL6180x_setRegister(uint16_t registerAddr, uint8_t data);
 uint16_t VL6180x_getRegister16bit(uint16_t registerAddr);
 uint8_t VL6180x_getRegister(uint16_t registerAddr);